@@ -0,0 +1,417 @@
+/**
+ * Loopback benchmark for TCPDataTransfer. Stands up listeners on 127.0.0.1, connects N connections through
+ * the consumer pool, sends M messages per connection from K producer threads and reports throughput and
+ * send to receive latency. Every message carries its send timestamp, receivers decode it on arrival.
+ */
+#include "TCPDataTransfer.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace TCPDataTransfer;
+
+namespace {
+using benchClock = std::chrono::steady_clock;
+
+struct benchOptions {
+    uint32_t connections{64};
+    uint64_t messages{10000}; // per connection
+    std::vector<size_t> sizes{128}; // frame payload sizes, cycled message by message
+    uint32_t producers{4};
+    uint32_t receivers{2};
+    uint16_t consumers{0}; // 0 lets the pool size itself
+    ReactorBackend backend{ReactorBackend::EPOLL};
+    ConsumerPinning pinning{ConsumerPinning::NONE};
+    bool coalesce{false};
+    uint32_t timeoutSec{120};
+};
+
+const size_t STAMP_SIZE = 16; // sequence and send time in front of every payload
+
+int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now().time_since_epoch()).count();
+}
+
+/**
+ * Log-linear histogram in the spirit of HdrHistogram: 2^SUB_BITS linear sub-buckets per power of two,
+ * so every recorded value is kept within 1% at a fixed few KB regardless of the range.
+ */
+class latencyHistogram {
+public:
+    static const int SUB_BITS = 7;
+    static const uint64_t SUB_COUNT = uint64_t(1) << SUB_BITS;
+
+    latencyHistogram() : counts_((64 - SUB_BITS + 1) * SUB_COUNT, 0) {}
+
+    void record(uint64_t value)
+    {
+        ++counts_[indexOf(value)];
+        ++total_;
+        maxValue_ = std::max(maxValue_, value);
+    }
+    void merge(const latencyHistogram& other)
+    {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        maxValue_ = std::max(maxValue_, other.maxValue_);
+    }
+    uint64_t total() const { return total_; }
+    uint64_t max() const { return maxValue_; }
+    /**
+     * Upper bound of the bucket holding the value at the given quantile, 0 without samples.
+     */
+    uint64_t percentile(double quantile) const
+    {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(total_))));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(upperBoundOf(i), maxValue_);
+            }
+        }
+        return maxValue_;
+    }
+private:
+    static size_t indexOf(uint64_t value)
+    {
+        if (value < SUB_COUNT) {
+            return static_cast<size_t>(value);
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BITS;
+        return static_cast<size_t>((shift + 1) * SUB_COUNT + ((value >> shift) - SUB_COUNT));
+    }
+    static uint64_t upperBoundOf(size_t index)
+    {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        int shift = static_cast<int>(index / SUB_COUNT) - 1;
+        uint64_t mantissa = index % SUB_COUNT + SUB_COUNT;
+        return ((mantissa + 1) << shift) - 1;
+    }
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_{0};
+    uint64_t maxValue_{0};
+};
+
+struct peerState {
+    int socketFd;
+    std::string buffer;
+};
+
+/**
+ * Listener stand-in: owns a set of accepted sockets on its own epoll and decodes the frames they carry.
+ */
+class receiver {
+public:
+    receiver(std::atomic<uint64_t>& received) : received_(received), epollFd_(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~receiver()
+    {
+        stop();
+        for (auto& peer : peers_) {
+            ::close(peer->socketFd);
+        }
+        ::close(epollFd_);
+    }
+    void adopt(int socketFd)
+    {
+        peers_.push_back(std::make_unique<peerState>(peerState{socketFd, {}}));
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = peers_.back().get();
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, socketFd, &event);
+    }
+    void start() { thread_ = std::thread(&receiver::run, this); }
+    void stop()
+    {
+        running_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+    const latencyHistogram& histogram() const { return histogram_; }
+    uint64_t bytes() const { return bytes_; }
+private:
+    void run()
+    {
+        epoll_event events[256];
+        char chunk[1 << 16];
+        while (running_) {
+            int count = epoll_wait(epollFd_, events, 256, 50);
+            for (int i = 0; i < count; ++i) {
+                auto* peer = static_cast<peerState*>(events[i].data.ptr);
+                ssize_t bytesRead = ::recv(peer->socketFd, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (bytesRead <= 0) {
+                    continue;
+                }
+                bytes_ += static_cast<uint64_t>(bytesRead);
+                peer->buffer.append(chunk, static_cast<size_t>(bytesRead));
+                decode(*peer);
+            }
+        }
+    }
+    void decode(peerState& peer)
+    {
+        int64_t arrival = nowNs();
+        size_t offset = 0;
+        uint64_t frames = 0;
+        while (peer.buffer.size() - offset >= FRAME_HEADER_SIZE) {
+            uint32_t length = 0;
+            std::memcpy(&length, peer.buffer.data() + offset, sizeof(length));
+            length = ntohl(length);
+            if (peer.buffer.size() - offset - FRAME_HEADER_SIZE < length) {
+                break;
+            }
+            int64_t sentNs = 0;
+            std::memcpy(&sentNs, peer.buffer.data() + offset + FRAME_HEADER_SIZE + sizeof(uint64_t), sizeof(sentNs));
+            histogram_.record(static_cast<uint64_t>(std::max<int64_t>(0, arrival - sentNs)));
+            offset += FRAME_HEADER_SIZE + length;
+            ++frames;
+        }
+        peer.buffer.erase(0, offset);
+        received_.fetch_add(frames, std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t>& received_;
+    int epollFd_;
+    std::atomic_bool running_{true};
+    std::thread thread_;
+    std::vector<std::unique_ptr<peerState>> peers_;
+    latencyHistogram histogram_;
+    uint64_t bytes_{0};
+};
+
+std::vector<size_t> parseSizes(const char* arg)
+{
+    std::vector<size_t> sizes;
+    std::string list(arg);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        size_t size = std::strtoull(list.substr(start, end - start).c_str(), nullptr, 10);
+        sizes.push_back(std::max(size, STAMP_SIZE));
+        start = end + 1;
+    }
+    return sizes;
+}
+
+void usage(const char* program)
+{
+    std::printf("usage: %s [options]\n"
+        "  -c, --connections N   connections to the loopback listener (64)\n"
+        "  -m, --messages M      messages per connection (10000)\n"
+        "  -s, --sizes A,B,...   payload sizes in bytes, cycled per message, at least %zu (128)\n"
+        "  -p, --producers K     producer threads (4)\n"
+        "  -r, --receivers R     receiving threads behind the listener (2)\n"
+        "  -n, --consumers C     pool consumers, 0 sizes the pool from the usable CPUs (0)\n"
+        "  -u, --io-uring        io_uring reactor instead of epoll\n"
+        "  -P, --pin             pin consumers to cores\n"
+        "  -C, --coalesce        coalesce small frames on every connection\n"
+        "  -t, --timeout SEC     give up waiting for receives after SEC seconds (120)\n", program, STAMP_SIZE);
+}
+
+bool parseOptions(int argc, char** argv, benchOptions& options)
+{
+    static const option longOptions[] = {
+        {"connections", required_argument, nullptr, 'c'}, {"messages", required_argument, nullptr, 'm'},
+        {"sizes", required_argument, nullptr, 's'}, {"producers", required_argument, nullptr, 'p'},
+        {"receivers", required_argument, nullptr, 'r'}, {"consumers", required_argument, nullptr, 'n'},
+        {"io-uring", no_argument, nullptr, 'u'}, {"pin", no_argument, nullptr, 'P'},
+        {"coalesce", no_argument, nullptr, 'C'}, {"timeout", required_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'}, {nullptr, 0, nullptr, 0}};
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "c:m:s:p:r:n:uPCt:h", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'c': options.connections = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'm': options.messages = std::strtoull(optarg, nullptr, 10); break;
+            case 's': options.sizes = parseSizes(optarg); break;
+            case 'p': options.producers = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'r': options.receivers = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'n': options.consumers = static_cast<uint16_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'u': options.backend = ReactorBackend::IO_URING; break;
+            case 'P': options.pinning = ConsumerPinning::CORE; break;
+            case 'C': options.coalesce = true; break;
+            case 't': options.timeoutSec = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            default: usage(argv[0]); return false;
+        }
+    }
+    if (options.connections == 0 || options.producers == 0 || options.receivers == 0 || options.sizes.empty()) {
+        usage(argv[0]);
+        return false;
+    }
+    options.producers = std::min(options.producers, options.connections);
+    return true;
+}
+
+int openListener(int& port)
+{
+    int listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || ::listen(listenFd, SOMAXCONN) < 0 || ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &addrLen) < 0) {
+        std::perror("listener");
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return listenFd;
+}
+}
+
+int main(int argc, char** argv)
+{
+    benchOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+    int port = 0;
+    int listenFd = openListener(port);
+    if (listenFd < 0) {
+        return 1;
+    }
+    consumerPoolOptions poolOptions;
+    poolOptions.backend = options.backend;
+    poolOptions.consumerCount = options.consumers;
+    poolOptions.pinning = options.pinning;
+    TCPDataTransfer::TCPDataTransfer::setPoolOptions(poolOptions);
+    auto& transfer = TCPDataTransfer::TCPDataTransfer::instance();
+
+    std::atomic<uint32_t> connected{0};
+    std::atomic<uint32_t> connectFailed{0};
+    transfer.setConnectCallback([&](uint64_t, int, int error) {
+        (error == 0 ? connected : connectFailed).fetch_add(1, std::memory_order_relaxed);
+    });
+    std::vector<connectRequest> requests;
+    for (uint32_t i = 0; i < options.connections; ++i) {
+        requests.push_back(connectRequest{i + 1, "127.0.0.1", port});
+    }
+    auto conns = transfer.buildConnections(requests);
+
+    std::atomic<uint64_t> received{0};
+    std::vector<std::unique_ptr<receiver>> receivers;
+    for (uint32_t i = 0; i < options.receivers; ++i) {
+        receivers.push_back(std::make_unique<receiver>(received));
+    }
+    for (uint32_t i = 0; i < options.connections; ++i) {
+        int peerFd = ::accept(listenFd, nullptr, nullptr);
+        if (peerFd < 0) {
+            std::perror("accept");
+            return 1;
+        }
+        receivers[i % options.receivers]->adopt(peerFd);
+    }
+    auto connectDeadline = benchClock::now() + std::chrono::seconds(10);
+    while (connected + connectFailed < options.connections && benchClock::now() < connectDeadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (connected != options.connections) {
+        std::fprintf(stderr, "only %u of %u connections established\n", connected.load(), options.connections);
+        return 1;
+    }
+    if (options.coalesce) {
+        for (uint32_t i = 0; i < options.connections; ++i) {
+            transfer.setConnCoalescing(conns[i].connId, true);
+        }
+    }
+    for (auto& peer : receivers) {
+        peer->start();
+    }
+
+    std::atomic<uint64_t> refused{0};
+    std::atomic<uint64_t> failed{0};
+    auto started = benchClock::now();
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < options.producers; ++p) {
+        producers.emplace_back([&, p] {
+            std::vector<char> frame(FRAME_HEADER_SIZE + *std::max_element(options.sizes.begin(), options.sizes.end()), 'x');
+            uint64_t localRefused = 0;
+            for (uint64_t seq = 0; seq < options.messages; ++seq) {
+                size_t size = options.sizes[seq % options.sizes.size()];
+                for (uint32_t i = p; i < options.connections; i += options.producers) {
+                    uint32_t length = htonl(static_cast<uint32_t>(size));
+                    std::memcpy(frame.data(), &length, sizeof(length));
+                    std::memcpy(frame.data() + FRAME_HEADER_SIZE, &seq, sizeof(seq));
+                    while (true) {
+                        int64_t sentNs = nowNs();
+                        std::memcpy(frame.data() + FRAME_HEADER_SIZE + sizeof(seq), &sentNs, sizeof(sentNs));
+                        auto result = transfer.sendData(conns[i].socketFd, conns[i].connId, frame.data(), FRAME_HEADER_SIZE + size);
+                        if (result == SendResult::OK) {
+                            break;
+                        }
+                        if (result != SendResult::WOULD_BLOCK && result != SendResult::OVER_LIMIT) {
+                            failed.fetch_add(1, std::memory_order_relaxed);
+                            break;
+                        }
+                        ++localRefused;
+                        std::this_thread::yield();
+                    }
+                }
+            }
+            refused.fetch_add(localRefused, std::memory_order_relaxed);
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    auto sent = benchClock::now();
+    uint64_t expected = static_cast<uint64_t>(options.connections) * options.messages - failed.load();
+    auto deadline = sent + std::chrono::seconds(options.timeoutSec);
+    while (received.load(std::memory_order_relaxed) < expected && benchClock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    auto finished = benchClock::now();
+    latencyHistogram latency;
+    uint64_t bytes = 0;
+    for (auto& peer : receivers) {
+        peer->stop();
+        latency.merge(peer->histogram());
+        bytes += peer->bytes();
+    }
+
+    double seconds = std::chrono::duration<double>(finished - started).count();
+    double sendSeconds = std::chrono::duration<double>(sent - started).count();
+    std::printf("connections %u, messages/conn %llu, producers %u, receivers %u, backend %s%s\n",
+        options.connections, static_cast<unsigned long long>(options.messages), options.producers, options.receivers,
+        options.backend == ReactorBackend::IO_URING ? "io_uring" : "epoll", options.coalesce ? ", coalescing" : "");
+    std::printf("received %llu/%llu msgs in %.3fs (producers done after %.3fs), refused %llu, failed %llu\n",
+        static_cast<unsigned long long>(received.load()), static_cast<unsigned long long>(expected), seconds, sendSeconds,
+        static_cast<unsigned long long>(refused.load()), static_cast<unsigned long long>(failed.load()));
+    std::printf("throughput %.0f msgs/s, %.2f MB/s\n", received.load() / seconds, bytes / seconds / (1 << 20));
+    std::printf("latency us p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", latency.percentile(0.5) / 1e3,
+        latency.percentile(0.99) / 1e3, latency.percentile(0.999) / 1e3, latency.max() / 1e3);
+
+    for (uint32_t i = 0; i < options.connections; ++i) {
+        transfer.removeConnection(conns[i].connId);
+    }
+    receivers.clear();
+    ::close(listenFd);
+    return received.load() == expected ? 0 : 2;
+}
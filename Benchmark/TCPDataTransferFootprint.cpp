@@ -0,0 +1,320 @@
+/**
+ * Memory footprint of idle connections. Opens N loopback connections through TCPDataTransfer and reports the
+ * resident set growth per connection, once right after connecting and once more after every connection moved
+ * one frame each way and went idle again, which is when receive buffers and send queues are allocated.
+ */
+#include "TCPDataTransfer.hpp"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace TCPDataTransfer;
+
+namespace {
+using benchClock = std::chrono::steady_clock;
+
+struct footprintOptions {
+    uint32_t connections{10000};
+    uint32_t listeners{0};   // 0 opens one per 20000 connections, each listener port takes a full ephemeral port range
+    uint32_t batch{1000};    // connects in flight at once
+    uint16_t consumers{0};   // 0 lets the pool size itself
+    bool compact{false};
+    size_t payload{64};
+    uint32_t timeoutSec{120};
+};
+
+const uint32_t CONNECTIONS_PER_LISTENER = 20000;
+
+// freed heap is trimmed first, only memory still held counts
+uint64_t residentBytes()
+{
+    malloc_trim(0);
+    unsigned long long pages = 0;
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (statm == nullptr || std::fscanf(statm, "%*s %llu", &pages) != 1) {
+        pages = 0;
+    }
+    if (statm != nullptr) {
+        std::fclose(statm);
+    }
+    return pages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+/**
+ * The peer side of every connection, accepts on all listeners from its own thread.
+ */
+class acceptor {
+public:
+    explicit acceptor(size_t expected) : accepted_(expected, -1), epollFd_(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~acceptor()
+    {
+        stop();
+        for (int peerFd : accepted_) {
+            if (peerFd >= 0) {
+                ::close(peerFd);
+            }
+        }
+        for (int listenFd : listeners_) {
+            ::close(listenFd);
+        }
+        ::close(epollFd_);
+    }
+    /**
+     * @return the listener's port, 0 if it could not be opened.
+     */
+    int listen()
+    {
+        int listenFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrLen = sizeof(addr);
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+            || ::listen(listenFd, SOMAXCONN) < 0 || ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &addrLen) < 0) {
+            std::perror("listener");
+            if (listenFd >= 0) {
+                ::close(listenFd);
+            }
+            return 0;
+        }
+        listeners_.push_back(listenFd);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listenFd;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd, &event);
+        return ntohs(addr.sin_port);
+    }
+    void start() { thread_ = std::thread(&acceptor::run, this); }
+    void stop()
+    {
+        running_ = false;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+    size_t count() const { return count_.load(std::memory_order_acquire); }
+    const std::vector<int>& peers() const { return accepted_; }
+private:
+    void run()
+    {
+        epoll_event events[64];
+        while (running_) {
+            int ready = epoll_wait(epollFd_, events, 64, 50);
+            for (int i = 0; i < ready; ++i) {
+                while (true) {
+                    int peerFd = ::accept4(events[i].data.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (peerFd < 0) {
+                        break;
+                    }
+                    size_t index = count_.load(std::memory_order_relaxed);
+                    if (index == accepted_.size()) {
+                        ::close(peerFd);
+                        continue;
+                    }
+                    accepted_[index] = peerFd;
+                    count_.store(index + 1, std::memory_order_release);
+                }
+            }
+        }
+    }
+private:
+    std::vector<int> accepted_; // sized up front so accepting allocates nothing inside the measurement
+    std::atomic<size_t> count_{0};
+    std::vector<int> listeners_;
+    int epollFd_;
+    std::atomic_bool running_{true};
+    std::thread thread_;
+};
+
+void usage(const char* program)
+{
+    std::printf("usage: %s [options]\n"
+        "  -c, --connections N   idle connections to open (10000)\n"
+        "  -l, --listeners L     loopback listener ports, 0 opens one per %u connections (0)\n"
+        "  -b, --batch B         connects in flight at once (1000)\n"
+        "  -n, --consumers C     pool consumers, 0 sizes the pool from the usable CPUs (0)\n"
+        "  -k, --compact         release receive buffers and send queues of idle connections\n"
+        "  -s, --payload BYTES   payload of the frame sent each way (64)\n"
+        "  -t, --timeout SEC     give up waiting for connects and frames after SEC seconds (120)\n",
+        program, CONNECTIONS_PER_LISTENER);
+}
+
+bool parseOptions(int argc, char** argv, footprintOptions& options)
+{
+    static const option longOptions[] = {
+        {"connections", required_argument, nullptr, 'c'}, {"listeners", required_argument, nullptr, 'l'},
+        {"batch", required_argument, nullptr, 'b'}, {"consumers", required_argument, nullptr, 'n'},
+        {"compact", no_argument, nullptr, 'k'}, {"payload", required_argument, nullptr, 's'},
+        {"timeout", required_argument, nullptr, 't'}, {"help", no_argument, nullptr, 'h'}, {nullptr, 0, nullptr, 0}};
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "c:l:b:n:ks:t:h", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'c': options.connections = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'l': options.listeners = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'b': options.batch = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'n': options.consumers = static_cast<uint16_t>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'k': options.compact = true; break;
+            case 's': options.payload = std::strtoull(optarg, nullptr, 10); break;
+            case 't': options.timeoutSec = static_cast<uint32_t>(std::strtoul(optarg, nullptr, 10)); break;
+            default: usage(argv[0]); return false;
+        }
+    }
+    if (options.connections == 0 || options.batch == 0) {
+        usage(argv[0]);
+        return false;
+    }
+    if (options.listeners == 0) {
+        options.listeners = (options.connections + CONNECTIONS_PER_LISTENER - 1) / CONNECTIONS_PER_LISTENER;
+    }
+    return true;
+}
+
+// both ends of every connection live in this process
+bool raiseFdLimit(uint32_t connections)
+{
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    rlim_t needed = static_cast<rlim_t>(connections) * 2 + 1024;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed) {
+        std::fprintf(stderr, "RLIMIT_NOFILE %llu is below the %llu fds needed, raise the hard limit\n",
+            static_cast<unsigned long long>(limit.rlim_cur), static_cast<unsigned long long>(needed));
+        return false;
+    }
+    return true;
+}
+
+template<typename Done>
+bool waitFor(Done&& done, benchClock::time_point deadline)
+{
+    while (!done()) {
+        if (benchClock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+double perConnection(uint64_t after, uint64_t before, uint32_t connections)
+{
+    return (static_cast<double>(after) - static_cast<double>(before)) / connections;
+}
+}
+
+int main(int argc, char** argv)
+{
+    footprintOptions options;
+    if (!parseOptions(argc, argv, options) || !raiseFdLimit(options.connections)) {
+        return 1;
+    }
+    consumerPoolOptions poolOptions;
+    poolOptions.consumerCount = options.consumers;
+    poolOptions.maxConnections = options.connections;
+    poolOptions.compactConnections = options.compact;
+    TCPDataTransfer::TCPDataTransfer::setPoolOptions(poolOptions);
+    auto& transfer = TCPDataTransfer::TCPDataTransfer::instance();
+
+    acceptor peers(options.connections);
+    std::vector<int> ports;
+    for (uint32_t i = 0; i < options.listeners; ++i) {
+        int port = peers.listen();
+        if (port == 0) {
+            return 1;
+        }
+        ports.push_back(port);
+    }
+    std::atomic<uint32_t> connected{0};
+    std::atomic<uint32_t> connectFailed{0};
+    transfer.setConnectCallback([&](uint64_t, int, int error) {
+        (error == 0 ? connected : connectFailed).fetch_add(1, std::memory_order_relaxed);
+    });
+    std::atomic<uint64_t> received{0};
+    transfer.setRecvCallback([&](uint64_t, const char*, size_t) { received.fetch_add(1, std::memory_order_relaxed); });
+    std::vector<connectInfo> conns(options.connections); // filled in before the baseline, only the transport's growth is measured
+    std::vector<connectRequest> requests;
+    requests.reserve(options.batch);
+    peers.start();
+    uint64_t baseline = residentBytes();
+
+    auto deadline = benchClock::now() + std::chrono::seconds(options.timeoutSec);
+    auto started = benchClock::now();
+    for (uint32_t first = 0; first < options.connections; first += options.batch) {
+        uint32_t last = std::min(options.connections, first + options.batch);
+        requests.clear();
+        for (uint32_t i = first; i < last; ++i) {
+            requests.push_back(connectRequest{i + 1, "127.0.0.1", ports[i % ports.size()]});
+        }
+        auto built = transfer.buildConnections(requests);
+        std::copy(built.begin(), built.end(), conns.begin() + first);
+        if (!waitFor([&] { return connected + connectFailed >= last; }, deadline)) {
+            break;
+        }
+    }
+    waitFor([&] { return peers.count() >= connected; }, deadline);
+    double connectSeconds = std::chrono::duration<double>(benchClock::now() - started).count();
+    if (connected != options.connections || peers.count() != options.connections) {
+        std::fprintf(stderr, "only %u of %u connections established, %zu accepted, %u failed\n",
+            connected.load(), options.connections, peers.count(), connectFailed.load());
+        return 1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    uint64_t idle = residentBytes();
+
+    // one frame each way, then give every connection time to go idle again
+    std::vector<char> frame(FRAME_HEADER_SIZE + options.payload, 'x');
+    uint32_t length = htonl(static_cast<uint32_t>(options.payload));
+    std::memcpy(frame.data(), &length, sizeof(length));
+    uint64_t failed = 0;
+    for (int peerFd : peers.peers()) {
+        if (::send(peerFd, frame.data(), frame.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(frame.size())) {
+            ++failed;
+        }
+    }
+    for (auto& conn : conns) {
+        if (transfer.sendData(conn.socketFd, conn.connId, frame.data(), frame.size()) != SendResult::OK) {
+            ++failed;
+        }
+    }
+    uint64_t expectedBytes = static_cast<uint64_t>(options.connections) * frame.size();
+    bool settled = waitFor([&] {
+        return received.load(std::memory_order_relaxed) >= options.connections && transfer.getMetrics().bytesSent >= expectedBytes;
+    }, benchClock::now() + std::chrono::seconds(options.timeoutSec));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    uint64_t afterTraffic = residentBytes();
+    auto pool = transfer.getBufferPoolStats();
+    uint64_t poolInUse = 0;
+    for (auto& sizeClass : pool.classes) {
+        poolInUse += sizeClass.inUse * sizeClass.blockBytes;
+    }
+
+    std::printf("connections %u over %u listeners, %s mode, connected in %.3fs\n", options.connections, options.listeners,
+        options.compact ? "compact" : "default", connectSeconds);
+    std::printf("rss baseline %.1f MB, idle %.1f MB, after one frame each way %.1f MB\n", baseline / 1048576.0,
+        idle / 1048576.0, afterTraffic / 1048576.0);
+    std::printf("bytes per idle connection: %.0f after connecting, %.0f after traffic\n",
+        perConnection(idle, baseline, options.connections), perConnection(afterTraffic, baseline, options.connections));
+    std::printf("buffer pool %.1f MB mapped, %.1f MB in use, %llu fallbacks, received %llu/%u frames, failed %llu\n",
+        pool.mappedBytes / 1048576.0, poolInUse / 1048576.0, static_cast<unsigned long long>(pool.fallbacks),
+        static_cast<unsigned long long>(received.load()), options.connections, static_cast<unsigned long long>(failed));
+
+    for (auto& conn : conns) {
+        transfer.removeConnection(conn.connId);
+    }
+    return settled && failed == 0 ? 0 : 2;
+}
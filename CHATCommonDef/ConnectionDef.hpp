@@ -16,5 +16,9 @@ struct connectInfo {
 
 const uint64_t MAX_CONNECTIONS = 25000;
 const uint64_t SOMAXCONN = 4096; // by setting /proc/sys/net/core/somaxconn
-const uint16_t MAX_EPOLL_CONSUMERS = 8;
-}
\ No newline at end of file
+const uint16_t MAX_EPOLL_CONSUMERS = 256; // upper bound, the pool sizes itself from the usable CPUs
+
+const uint32_t FRAME_HEADER_SIZE = 4; // big-endian payload length in front of every frame
+const uint32_t MAX_FRAME_SIZE = 16 << 20; // larger frames are treated as a broken stream
+const size_t RECV_BUFFER_SIZE = 64 << 10; // initial per-connection receive buffer, grows for bigger frames
+}
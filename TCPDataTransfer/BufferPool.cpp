@@ -0,0 +1,215 @@
+#include "BufferPool.hpp"
+#include "LogMacro.hpp"
+#include <sys/mman.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace TCPDataTransfer {
+namespace {
+const uint64_t POINTER_MASK = (uint64_t(1) << 48) - 1; // user space addresses fit 48 bits, the upper 16 hold the tag
+const uint64_t TAG_ONE = uint64_t(1) << 48;
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+size_t roundUp(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+}
+
+std::unique_ptr<BufferPool, BufferPool::retirer> BufferPool::create(const bufferPoolOptions& options, int ownerTag)
+{
+    return std::unique_ptr<BufferPool, retirer>(new BufferPool(options, ownerTag));
+}
+
+BufferPool::BufferPool(const bufferPoolOptions& options, int ownerTag) : options_(options), ownerTag_(ownerTag)
+{
+    // whole slabs for every class, MAP_HUGETLB also wants whole huge pages
+    options_.slabBytes = roundUp(std::max(options_.slabBytes, MAX_BLOCK_BYTES), options_.hugePages ? HUGE_PAGE_BYTES : MAX_BLOCK_BYTES);
+    LOG_INFO("BufferPool" << ownerTag_ << " created, " << options_.slabBytes << " byte slabs up to " << options_.maxBytes
+        << " bytes" << (options_.hugePages ? ", huge pages" : ""));
+}
+
+BufferPool::~BufferPool()
+{
+    for (auto& [slab, bytes] : slabs_) {
+        munmap(slab, bytes);
+    }
+}
+
+// blocks still out keep the pool alive, the last release() deletes it
+void BufferPool::retire()
+{
+    if (state_.fetch_or(1, std::memory_order_acq_rel) == 0) {
+        delete this;
+    }
+}
+
+size_t BufferPool::classOf(size_t bytes)
+{
+    if (bytes <= (size_t(1) << MIN_BLOCK_SHIFT)) {
+        return 0;
+    }
+    return static_cast<size_t>(64 - __builtin_clzll(bytes - 1)) - MIN_BLOCK_SHIFT;
+}
+
+void* BufferPool::pop(sizeClass& sizeClass)
+{
+    uint64_t head = sizeClass.head.load(std::memory_order_acquire);
+    while (true) {
+        auto* block = reinterpret_cast<uint64_t*>(head & POINTER_MASK);
+        if (block == nullptr) {
+            return nullptr;
+        }
+        // the block may be popped and reused meanwhile, the tag then makes the exchange fail
+        uint64_t next = __atomic_load_n(block, __ATOMIC_RELAXED);
+        uint64_t tagged = (next & POINTER_MASK) | ((head & ~POINTER_MASK) + TAG_ONE);
+        if (sizeClass.head.compare_exchange_weak(head, tagged, std::memory_order_acquire, std::memory_order_acquire)) {
+            return block;
+        }
+    }
+}
+
+void BufferPool::push(sizeClass& sizeClass, void* block)
+{
+    uint64_t head = sizeClass.head.load(std::memory_order_relaxed);
+    uint64_t tagged = 0;
+    do {
+        __atomic_store_n(static_cast<uint64_t*>(block), head & POINTER_MASK, __ATOMIC_RELAXED);
+        tagged = reinterpret_cast<uintptr_t>(block) | ((head & ~POINTER_MASK) + TAG_ONE);
+    } while (!sizeClass.head.compare_exchange_weak(head, tagged, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void* BufferPool::allocate(size_t bytes, bool capped)
+{
+    if (bytes > MAX_BLOCK_BYTES) {
+        return nullptr;
+    }
+    size_t index = classOf(bytes);
+    void* block = pop(classes_[index]);
+    if (block == nullptr) {
+        block = grow(index, capped);
+        if (block == nullptr) {
+            return nullptr;
+        }
+    }
+    classes_[index].inUse.fetch_add(1, std::memory_order_relaxed);
+    state_.fetch_add(2, std::memory_order_relaxed);
+    return block;
+}
+
+void BufferPool::release(void* block, size_t bytes)
+{
+    auto& sizeClass = classes_[classOf(bytes)];
+    push(sizeClass, block);
+    sizeClass.inUse.fetch_sub(1, std::memory_order_relaxed);
+    if (state_.fetch_sub(2, std::memory_order_acq_rel) == 3) {
+        delete this; // retired and this was the last block out
+    }
+}
+
+// blocks are cut one at a time so untouched slab pages stay unbacked
+void* BufferPool::grow(size_t index, bool capped)
+{
+    std::lock_guard<std::mutex> lock(growMutex_);
+    auto& sizeClass = classes_[index];
+    void* block = pop(sizeClass);
+    if (block != nullptr) {
+        return block; // released while this thread waited for the lock
+    }
+    size_t blockBytes = size_t(1) << (index + MIN_BLOCK_SHIFT);
+    if (sizeClass.bumpNext == nullptr || sizeClass.bumpNext + blockBytes > sizeClass.bumpEnd) {
+        if (capped && mappedBytes_.load(std::memory_order_relaxed) + options_.slabBytes > options_.maxBytes) {
+            return nullptr;
+        }
+        char* slab = mapSlab();
+        if (slab == nullptr) {
+            return nullptr;
+        }
+        sizeClass.bumpNext = slab;
+        sizeClass.bumpEnd = slab + options_.slabBytes;
+    }
+    block = sizeClass.bumpNext;
+    sizeClass.bumpNext += blockBytes;
+    sizeClass.blocks.fetch_add(1, std::memory_order_relaxed);
+    return block;
+}
+
+char* BufferPool::mapSlab()
+{
+    size_t bytes = options_.slabBytes;
+    void* slab = MAP_FAILED;
+    if (options_.hugePages && !hugePagesRefused_) {
+        slab = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab == MAP_FAILED) {
+            LOG_WARNING("BufferPool" << ownerTag_ << ", no huge pages available (" << strerror(errno)
+                << "), falling back to transparent huge pages");
+            hugePagesRefused_ = true;
+        } else {
+            hugePageSlabs_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (slab == MAP_FAILED) {
+        slab = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            LOG_ERROR("BufferPool" << ownerTag_ << ", failed to map a " << bytes << " byte slab: " << strerror(errno));
+            return nullptr;
+        }
+        if (options_.hugePages) {
+            madvise(slab, bytes, MADV_HUGEPAGE);
+        }
+    }
+    slabs_.emplace_back(static_cast<char*>(slab), bytes);
+    mappedBytes_.fetch_add(bytes, std::memory_order_relaxed);
+    return static_cast<char*>(slab);
+}
+
+PayloadBuffer BufferPool::copyOf(const char* data, size_t len)
+{
+    sendSpan span{data, len};
+    return copyOf(&span, 1);
+}
+
+PayloadBuffer BufferPool::copyOf(const sendSpan* spans, size_t count)
+{
+    size_t len = PayloadBuffer::totalSize(spans, count);
+    if (len == 0) {
+        return PayloadBuffer();
+    }
+    auto* block = static_cast<char*>(tryAllocate(len));
+    if (block == nullptr) {
+        fallbacks_.fetch_add(1, std::memory_order_relaxed);
+        return PayloadBuffer::copyOf(spans, count);
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+        std::memcpy(block + offset, spans[i].data, spans[i].len);
+        offset += spans[i].len;
+    }
+    try {
+        // the control block comes from the pool as well, through the allocator
+        std::shared_ptr<const void> owner(block, [this, len](char* bytes) { release(bytes, len); }, PoolAllocator<char>(this));
+        return PayloadBuffer(std::move(owner), block, len);
+    } catch (const std::bad_alloc&) {
+        // the deleter already took the block back
+        fallbacks_.fetch_add(1, std::memory_order_relaxed);
+        return PayloadBuffer::copyOf(spans, count);
+    }
+}
+
+bufferPoolStats BufferPool::stats() const
+{
+    bufferPoolStats stats;
+    stats.classes.resize(CLASS_COUNT);
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        stats.classes[i].blockBytes = size_t(1) << (i + MIN_BLOCK_SHIFT);
+        stats.classes[i].blocks = classes_[i].blocks.load(std::memory_order_relaxed);
+        stats.classes[i].inUse = classes_[i].inUse.load(std::memory_order_relaxed);
+    }
+    stats.mappedBytes = mappedBytes_.load(std::memory_order_relaxed);
+    stats.slabs = stats.mappedBytes / options_.slabBytes;
+    stats.hugePageSlabs = hugePageSlabs_.load(std::memory_order_relaxed);
+    stats.fallbacks = fallbacks_.load(std::memory_order_relaxed);
+    return stats;
+}
+}
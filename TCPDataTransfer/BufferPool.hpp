@@ -0,0 +1,164 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "PayloadBuffer.hpp"
+
+namespace TCPDataTransfer {
+struct bufferPoolOptions {
+    size_t maxBytes{256 << 20}; // slab memory payload copies and receive buffers may take, beyond it they use the global allocator, 0 disables the pool
+    size_t slabBytes{2 << 20};  // mapped at once, every slab serves one size class
+    bool hugePages{false};      // map slabs with MAP_HUGETLB, falls back to transparent huge pages when none are reserved
+};
+
+struct bufferClassStats {
+    size_t blockBytes{0};
+    uint64_t blocks{0}; // handed out at least once, the rest of the class's slabs is untouched
+    uint64_t inUse{0};
+};
+
+struct bufferPoolStats {
+    std::vector<bufferClassStats> classes;
+    uint64_t mappedBytes{0};
+    uint64_t slabs{0};
+    uint64_t hugePageSlabs{0};
+    uint64_t fallbacks{0}; // payload copies that went to the global allocator, too large or over maxBytes
+
+    bufferPoolStats& operator+=(const bufferPoolStats& other)
+    {
+        if (classes.size() < other.classes.size()) {
+            classes.resize(other.classes.size());
+        }
+        for (size_t i = 0; i < other.classes.size(); ++i) {
+            classes[i].blockBytes = other.classes[i].blockBytes;
+            classes[i].blocks += other.classes[i].blocks;
+            classes[i].inUse += other.classes[i].inUse;
+        }
+        mappedBytes += other.mappedBytes;
+        slabs += other.slabs;
+        hugePageSlabs += other.hugePageSlabs;
+        fallbacks += other.fallbacks;
+        return *this;
+    }
+};
+
+/**
+ * Power of two size classes from 64 bytes to 1MB, cut from slabs that are never unmapped while the pool lives.
+ * Any thread may allocate and release, free blocks sit in one lock free stack per class and the lock is only
+ * taken to cut fresh blocks, so a warmed up pool never calls into the global allocator.
+ * Blocks carry no header, the caller hands the size back on release and the class follows from it.
+ * Owners retire() the pool instead of deleting it, it goes away with the last block still out.
+ */
+class BufferPool {
+public:
+    static constexpr size_t MIN_BLOCK_SHIFT = 6;
+    static constexpr size_t MAX_BLOCK_SHIFT = 20;
+    static constexpr size_t MAX_BLOCK_BYTES = size_t(1) << MAX_BLOCK_SHIFT;
+    static constexpr size_t CLASS_COUNT = MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT + 1;
+
+    struct retirer {
+        void operator()(BufferPool* pool) const { pool->retire(); }
+    };
+    static std::unique_ptr<BufferPool, retirer> create(const bufferPoolOptions& options, int ownerTag);
+
+    /**
+     * Block of at least bytes, regardless of maxBytes. nullptr above MAX_BLOCK_BYTES or when mapping failed.
+     */
+    void* allocate(size_t bytes) { return allocate(bytes, false); }
+    /**
+     * Same, but nullptr once maxBytes are mapped and the class has no free block left.
+     */
+    void* tryAllocate(size_t bytes) { return allocate(bytes, true); }
+    void release(void* block, size_t bytes);
+    /**
+     * Copies into a pooled block with a pooled shared_ptr control block, falls back to PayloadBuffer::copyOf.
+     */
+    PayloadBuffer copyOf(const char* data, size_t len);
+    /**
+     * Same for a message in parts, the spans are copied back to back into one block.
+     */
+    PayloadBuffer copyOf(const sendSpan* spans, size_t count);
+    bufferPoolStats stats() const;
+private:
+    struct alignas(64) sizeClass {
+        std::atomic<uint64_t> head{0}; // tagged pointer to the first free block, the tag defeats ABA
+        std::atomic<uint64_t> inUse{0};
+        std::atomic<uint64_t> blocks{0};
+        char* bumpNext{nullptr}; // uncut rest of the class's newest slab, guarded by growMutex_
+        char* bumpEnd{nullptr};
+    };
+
+    BufferPool(const bufferPoolOptions& options, int ownerTag);
+    ~BufferPool();
+    void retire();
+    void* allocate(size_t bytes, bool capped);
+    void* grow(size_t index, bool capped);
+    char* mapSlab();
+    static size_t classOf(size_t bytes);
+    static void* pop(sizeClass& sizeClass);
+    static void push(sizeClass& sizeClass, void* block);
+private:
+    bufferPoolOptions options_;
+    int ownerTag_;
+    std::array<sizeClass, CLASS_COUNT> classes_;
+    std::mutex growMutex_;
+    std::vector<std::pair<char*, size_t>> slabs_; // guarded by growMutex_
+    std::atomic<uint64_t> mappedBytes_{0};
+    std::atomic<uint64_t> hugePageSlabs_{0};
+    std::atomic<uint64_t> fallbacks_{0};
+    std::atomic<uint64_t> state_{0}; // blocks out times two, plus one once retired
+    bool hugePagesRefused_{false};   // guarded by growMutex_
+};
+
+/**
+ * Standard allocator over a BufferPool, without a pool or above MAX_BLOCK_BYTES it uses the global allocator.
+ * The choice only depends on the pool and the size, so deallocate always returns memory where it came from.
+ */
+template<typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    explicit PoolAllocator(BufferPool* pool = nullptr) noexcept : pool_(pool) {}
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept : pool_(other.pool()) {}
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (!pooled(bytes)) {
+            return static_cast<T*>(::operator new(bytes));
+        }
+        void* block = pool_->allocate(bytes);
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(block);
+    }
+    void deallocate(T* p, size_t n) noexcept
+    {
+        size_t bytes = n * sizeof(T);
+        if (!pooled(bytes)) {
+            ::operator delete(p);
+            return;
+        }
+        pool_->release(p, bytes);
+    }
+    BufferPool* pool() const noexcept { return pool_; }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>& other) const noexcept { return pool_ == other.pool(); }
+    template<typename U>
+    bool operator!=(const PoolAllocator<U>& other) const noexcept { return pool_ != other.pool(); }
+private:
+    bool pooled(size_t bytes) const noexcept { return pool_ != nullptr && bytes <= BufferPool::MAX_BLOCK_BYTES; }
+private:
+    BufferPool* pool_;
+};
+}
@@ -0,0 +1,69 @@
+#include "ConnectionTable.hpp"
+#include "LogMacro.hpp"
+#include <sys/resource.h>
+#include <algorithm>
+#include <thread>
+
+namespace TCPDataTransfer {
+namespace {
+size_t fdLimit(size_t maxConnections)
+{
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return MAX_CONNECTION_TABLE_FDS;
+    }
+    // every connection needs an fd, leave room for the ones the process opens besides sockets
+    size_t floor = std::min(maxConnections * 2, MAX_CONNECTION_TABLE_FDS);
+    return std::clamp<size_t>(limit.rlim_cur, floor, MAX_CONNECTION_TABLE_FDS);
+}
+}
+
+ConnectionTable::ConnectionTable(size_t maxConnections)
+    : capacity_(fdLimit(maxConnections)), slots_(std::make_unique<slot[]>(capacity_))
+{
+    LOG_INFO("ConnectionTable created with " << capacity_ << " fd slots of " << sizeof(slot) << " bytes");
+}
+
+bool ConnectionTable::publish(int socketFd, uint64_t connId, uint16_t consumer)
+{
+    if (socketFd < 0 || static_cast<size_t>(socketFd) >= capacity_) {
+        LOG_ERROR("socket fd " << socketFd << " is outside the connection table of " << capacity_ << " slots");
+        return false;
+    }
+    slot& entry = slots_[socketFd];
+    uint64_t previous = entry.connId.exchange(INVALID_CONN_ID, std::memory_order_acq_rel);
+    if (previous != INVALID_CONN_ID) {
+        LOG_WARNING("socket fd " << socketFd << " reused, dropping stale route of connId " << previous);
+    }
+    entry.consumer.store(consumer, std::memory_order_release);
+    entry.queuedBytes.store(0, std::memory_order_relaxed);
+    entry.blocked.store(false, std::memory_order_relaxed);
+    entry.connId.store(connId, std::memory_order_release);
+    return true;
+}
+
+bool ConnectionTable::retire(int socketFd, uint64_t connId)
+{
+    if (socketFd < 0 || static_cast<size_t>(socketFd) >= capacity_) {
+        return false;
+    }
+    return slots_[socketFd].connId.compare_exchange_strong(connId, INVALID_CONN_ID, std::memory_order_acq_rel);
+}
+
+bool ConnectionTable::reroute(int socketFd, uint64_t connId, uint16_t consumer)
+{
+    if (socketFd < 0 || static_cast<size_t>(socketFd) >= capacity_) {
+        return false;
+    }
+    slot& entry = slots_[socketFd];
+    if (entry.connId.load(std::memory_order_acquire) != connId) {
+        return false;
+    }
+    entry.consumer.store(consumer, std::memory_order_seq_cst);
+    // pins are only held across one enqueue, this drains within microseconds
+    while (entry.pins.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+    }
+    return entry.connId.load(std::memory_order_acquire) == connId;
+}
+}
\ No newline at end of file
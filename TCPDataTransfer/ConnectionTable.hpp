@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace TCPDataTransfer {
+const uint64_t INVALID_CONN_ID = UINT64_MAX;
+const size_t MAX_CONNECTION_TABLE_FDS = 1 << 22; // upper bound on the fd range the table covers
+
+/**
+ * Flat, fd-indexed routing table from a socket to the consumer that owns it.
+ * Lookups are a few atomic loads on one slot, no lock and no tree walk. Publishing and retiring a slot
+ * happen on connect/disconnect only and are lock free as well. A slot only matches when the
+ * caller's connId is the one currently stored, so a reused fd never routes to the old connection.
+ * Sized once from RLIMIT_NOFILE, but never below twice the connection cap, fds beyond it are rejected.
+ * Callers that hand a command to the routed consumer hold a pin on the slot meanwhile, reroute() waits
+ * for those pins so nothing is still on its way to the old consumer once it returns.
+ */
+class ConnectionTable {
+public:
+    explicit ConnectionTable(size_t maxConnections);
+
+    /**
+     * Binds socketFd to connId and consumer, a stale entry left on the fd is overwritten.
+     * @return false if socketFd is outside the table.
+     */
+    bool publish(int socketFd, uint64_t connId, uint16_t consumer);
+    /**
+     * Clears the slot only if it still belongs to connId.
+     * @return false if the slot was held by another connection or empty.
+     */
+    bool retire(int socketFd, uint64_t connId);
+    /**
+     * @return true and the owning consumer if socketFd currently belongs to connId.
+     */
+    bool lookup(int socketFd, uint64_t connId, uint16_t& consumer) const
+    {
+        if (socketFd < 0 || static_cast<size_t>(socketFd) >= capacity_) {
+            return false;
+        }
+        const slot& entry = slots_[socketFd];
+        if (entry.connId.load(std::memory_order_acquire) != connId) {
+            return false;
+        }
+        consumer = entry.consumer.load(std::memory_order_relaxed);
+        // the slot may have been handed to another connection between the two loads
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return entry.connId.load(std::memory_order_relaxed) == connId;
+    }
+    /**
+     * lookup() that keeps the route stable until unpin(), always unpin after a successful pin.
+     */
+    bool pin(int socketFd, uint64_t connId, uint16_t& consumer)
+    {
+        if (socketFd < 0 || static_cast<size_t>(socketFd) >= capacity_) {
+            return false;
+        }
+        slot& entry = slots_[socketFd];
+        entry.pins.fetch_add(1, std::memory_order_seq_cst);
+        if (entry.connId.load(std::memory_order_seq_cst) != connId) {
+            entry.pins.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+        consumer = entry.consumer.load(std::memory_order_seq_cst);
+        return true;
+    }
+    void unpin(int socketFd)
+    {
+        slots_[socketFd].pins.fetch_sub(1, std::memory_order_release);
+    }
+    /**
+     * Points connId at another consumer and waits until every caller pinned on the old route let go.
+     * @return false if socketFd no longer belongs to connId.
+     */
+    bool reroute(int socketFd, uint64_t connId, uint16_t consumer);
+    /**
+     * Per connection send budget, charged by producers and credited by the owning consumer as bytes reach the kernel.
+     * Charging fails when it takes a non empty queue above highWater, the slot is then marked blocked.
+     * The caller must hold a pin or own the connection.
+     */
+    bool charge(int socketFd, size_t bytes, size_t highWater)
+    {
+        slot& entry = slots_[socketFd];
+        if (fits(entry, bytes, highWater)) {
+            entry.queuedBytes.fetch_add(bytes, std::memory_order_seq_cst);
+            return true;
+        }
+        entry.blocked.store(true, std::memory_order_seq_cst);
+        // the consumer may have drained the queue before it could see the mark
+        if (fits(entry, bytes, highWater)) {
+            entry.queuedBytes.fetch_add(bytes, std::memory_order_seq_cst);
+            return true;
+        }
+        return false;
+    }
+    void markBlocked(int socketFd)
+    {
+        slots_[socketFd].blocked.store(true, std::memory_order_seq_cst);
+    }
+    /**
+     * @return true once for a blocked slot that dropped to lowWater or below, the caller reports it writable.
+     */
+    bool credit(int socketFd, size_t bytes, size_t lowWater)
+    {
+        slot& entry = slots_[socketFd];
+        uint64_t queued = entry.queuedBytes.fetch_sub(bytes, std::memory_order_seq_cst) - bytes;
+        return queued <= lowWater && entry.blocked.load(std::memory_order_seq_cst)
+            && entry.blocked.exchange(false, std::memory_order_seq_cst);
+    }
+    bool takeBlocked(int socketFd, size_t lowWater)
+    {
+        slot& entry = slots_[socketFd];
+        return entry.queuedBytes.load(std::memory_order_seq_cst) <= lowWater && entry.blocked.load(std::memory_order_seq_cst)
+            && entry.blocked.exchange(false, std::memory_order_seq_cst);
+    }
+    /**
+     * Calls onEntry(int socketFd, uint64_t connId) for every occupied slot, not safe against concurrent publish.
+     */
+    template<typename OnEntry>
+    void forEach(OnEntry&& onEntry) const
+    {
+        for (size_t fd = 0; fd < capacity_; ++fd) {
+            uint64_t connId = slots_[fd].connId.load(std::memory_order_acquire);
+            if (connId != INVALID_CONN_ID) {
+                onEntry(static_cast<int>(fd), connId);
+            }
+        }
+    }
+    size_t capacity() const { return capacity_; }
+private:
+    // one per fd whether it is used or not, ordered by size so a slot packs into 24 bytes
+    struct slot {
+        std::atomic<uint64_t> connId{INVALID_CONN_ID};
+        std::atomic<uint64_t> queuedBytes{0};  // accepted by sendData, not yet written to the socket
+        std::atomic<uint32_t> pins{0};
+        std::atomic<uint16_t> consumer{0};
+        std::atomic<bool> blocked{false};      // a send was refused since the last writable notification
+    };
+
+    static bool fits(const slot& entry, size_t bytes, size_t highWater)
+    {
+        uint64_t queued = entry.queuedBytes.load(std::memory_order_seq_cst);
+        return queued == 0 || queued + bytes <= highWater;
+    }
+    size_t capacity_;
+    std::unique_ptr<slot[]> slots_;
+};
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace TCPDataTransfer {
+/**
+ * Power of two histogram, bucket 0 counts zeros and bucket i values in [2^(i-1), 2^i). Coarse but
+ * enough to tell a consumer that waits idle from one that spins through full batches.
+ */
+struct log2Histogram {
+    static const size_t BUCKETS = 48;
+    std::array<uint64_t, BUCKETS> buckets{};
+    uint64_t count{0};
+    uint64_t sum{0};
+
+    static size_t bucketOf(uint64_t value)
+    {
+        size_t bucket = value == 0 ? 0 : static_cast<size_t>(64 - __builtin_clzll(value));
+        return bucket < BUCKETS ? bucket : BUCKETS - 1;
+    }
+    double mean() const { return count == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(count); }
+    /**
+     * Upper bound of the bucket holding the value at quantile, 0 without samples.
+     */
+    uint64_t percentile(double quantile) const
+    {
+        uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen > rank || (seen == count && seen > 0)) {
+                return i == 0 ? 0 : (uint64_t(1) << i) - 1;
+            }
+        }
+        return 0;
+    }
+    log2Histogram& operator+=(const log2Histogram& other)
+    {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        sum += other.sum;
+        return *this;
+    }
+};
+
+/**
+ * Point in time copy of one consumer's counters, or their sum over a pool.
+ */
+struct consumerMetrics {
+    uint64_t waits{0};             // reactor waits that returned, empty busy poll spins excluded
+    uint64_t events{0};            // socket and wakeup events they reported
+    log2Histogram eventsPerWait;
+    log2Histogram loopNs;          // time from a wait returning to the next wait, i.e. the work of one round
+    uint64_t spinWaits{0};         // zero timeout busy poll waits that found nothing
+    uint64_t spinNs{0};            // time those spent, to compare against loopNs.sum
+    uint64_t commands{0};          // commands taken from the submission queue
+    uint64_t messagesQueued{0};    // SEND commands appended to a connection's send queue
+    uint64_t bytesSent{0};         // bytes handed to the kernel
+    uint64_t bytesReceived{0};
+    uint64_t partialSends{0};      // flushes cut short by a full socket buffer after sending some bytes
+    uint64_t eagain{0};            // flushes that found the socket buffer already full
+    uint64_t sendErrors{0};
+    uint64_t recvErrors{0};        // failed reads, oversized frames and broken allocations
+    uint64_t queuedBytes{0};       // accepted by sendData, not yet handed to the kernel
+    uint64_t queuedEntries{0};     // send queue entries across all connections, a coalesced segment counts once
+    uint32_t connections{0};
+    uint64_t sndBufGrows{0};       // SO_SNDBUF raised by the adaptive tuner
+    uint64_t sndBufShrinks{0};
+
+    consumerMetrics& operator+=(const consumerMetrics& other)
+    {
+        waits += other.waits;
+        events += other.events;
+        eventsPerWait += other.eventsPerWait;
+        loopNs += other.loopNs;
+        spinWaits += other.spinWaits;
+        spinNs += other.spinNs;
+        commands += other.commands;
+        messagesQueued += other.messagesQueued;
+        bytesSent += other.bytesSent;
+        bytesReceived += other.bytesReceived;
+        partialSends += other.partialSends;
+        eagain += other.eagain;
+        sendErrors += other.sendErrors;
+        recvErrors += other.recvErrors;
+        queuedBytes += other.queuedBytes;
+        queuedEntries += other.queuedEntries;
+        connections += other.connections;
+        sndBufGrows += other.sndBufGrows;
+        sndBufShrinks += other.sndBufShrinks;
+        return *this;
+    }
+};
+
+/**
+ * Single writer counter, the owning consumer thread adds without a locked instruction and readers load relaxed.
+ */
+class metricCounter {
+public:
+    void add(uint64_t value) { value_.store(value_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+    void sub(uint64_t value) { value_.store(value_.load(std::memory_order_relaxed) - value, std::memory_order_relaxed); }
+    uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+class metricHistogram {
+public:
+    void record(uint64_t value)
+    {
+        buckets_[log2Histogram::bucketOf(value)].add(1);
+        count_.add(1);
+        sum_.add(value);
+    }
+    log2Histogram snapshot() const
+    {
+        log2Histogram histogram;
+        for (size_t i = 0; i < log2Histogram::BUCKETS; ++i) {
+            histogram.buckets[i] = buckets_[i].load();
+        }
+        histogram.count = count_.load();
+        histogram.sum = sum_.load();
+        return histogram;
+    }
+private:
+    std::array<metricCounter, log2Histogram::BUCKETS> buckets_;
+    metricCounter count_;
+    metricCounter sum_;
+};
+
+/**
+ * Live counters of one consumer, written by its thread only.
+ */
+struct consumerCounters {
+    metricCounter waits;
+    metricCounter events;
+    metricHistogram eventsPerWait;
+    metricHistogram loopNs;
+    metricCounter spinWaits;
+    metricCounter spinNs;
+    metricCounter commands;
+    metricCounter messagesQueued;
+    metricCounter bytesSent;
+    metricCounter bytesReceived;
+    metricCounter partialSends;
+    metricCounter eagain;
+    metricCounter sendErrors;
+    metricCounter recvErrors;
+    metricCounter queuedEntries;
+    metricCounter sndBufGrows;
+    metricCounter sndBufShrinks;
+};
+}
@@ -0,0 +1,106 @@
+#include "CpuTopology.hpp"
+#include "LogMacro.hpp"
+#include <sched.h>
+#include <dirent.h>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <map>
+
+namespace TCPDataTransfer {
+namespace {
+// cgroup v2 cpu.max holds "<quota> <period>" or "max <period>", v1 splits them over two files
+unsigned readQuotaCpus()
+{
+    long long quota = -1;
+    long long period = 0;
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    if (v2) {
+        std::string quotaText;
+        v2 >> quotaText >> period;
+        if (quotaText != "max") {
+            try {
+                quota = std::stoll(quotaText);
+            } catch (const std::exception&) {
+                quota = -1;
+            }
+        }
+    } else {
+        std::ifstream quotaFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream periodFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (quotaFile && periodFile) {
+            quotaFile >> quota;
+            periodFile >> period;
+        }
+    }
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return static_cast<unsigned>((quota + period - 1) / period);
+}
+
+int readNodeOfCpu(int cpu)
+{
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = ::opendir(path.c_str());
+    if (!dir) {
+        return 0;
+    }
+    int node = 0;
+    while (dirent* entry = ::readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "node") == 0 && name.size() > 4 && std::isdigit(static_cast<unsigned char>(name[4]))) {
+            node = std::stoi(name.substr(4));
+            break;
+        }
+    }
+    ::closedir(dir);
+    return node;
+}
+}
+
+cpuTopology cpuTopology::detect()
+{
+    cpuTopology topology;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &mask)) {
+                topology.cpus.push_back(cpu);
+            }
+        }
+    }
+    if (topology.cpus.empty()) {
+        topology.cpus.push_back(0);
+    }
+    topology.nodeOfCpu.assign(topology.cpus.back() + 1, 0);
+    for (int cpu : topology.cpus) {
+        topology.nodeOfCpu[cpu] = readNodeOfCpu(cpu);
+    }
+    topology.quotaCpus = readQuotaCpus();
+    LOG_INFO("cpu topology: " << topology.cpus.size() << " cpus allowed, cgroup quota " << topology.quotaCpus
+        << " cpus, " << topology.cpusByNode().size() << " numa nodes");
+    return topology;
+}
+
+unsigned cpuTopology::usableCpus() const
+{
+    unsigned allowed = static_cast<unsigned>(cpus.size());
+    return quotaCpus > 0 ? std::min(allowed, quotaCpus) : allowed;
+}
+
+std::vector<std::vector<int>> cpuTopology::cpusByNode() const
+{
+    std::map<int, std::vector<int>> nodes;
+    for (int cpu : cpus) {
+        nodes[nodeOfCpu[cpu]].push_back(cpu);
+    }
+    std::vector<std::vector<int>> grouped;
+    for (auto& [node, nodeCpus] : nodes) {
+        grouped.push_back(std::move(nodeCpus));
+    }
+    return grouped;
+}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+namespace TCPDataTransfer {
+enum class ConsumerPinning { NONE, CORE, NUMA_NODE };
+
+/**
+ * CPUs this process may use, read once from the affinity mask, the cgroup cpu quota and sysfs.
+ */
+struct cpuTopology {
+    std::vector<int> cpus;      // CPUs in the affinity mask, ascending
+    std::vector<int> nodeOfCpu; // indexed by cpu id, 0 when the kernel reports no NUMA layout
+    unsigned quotaCpus{0};      // cgroup quota rounded up to whole CPUs, 0 without a quota
+
+    static cpuTopology detect();
+    /**
+     * How many CPUs the process can keep busy, the smaller of the affinity mask and the quota.
+     */
+    unsigned usableCpus() const;
+    /**
+     * Allowed CPUs grouped per NUMA node, nodes without allowed CPUs are left out.
+     */
+    std::vector<std::vector<int>> cpusByNode() const;
+};
+}
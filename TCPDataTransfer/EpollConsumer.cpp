@@ -1,211 +1,1279 @@
+#include "EpollConsumer.hpp"
+#include "LogMacro.hpp"
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <shared_mutex>
-#include "EpollConsumer.hpp"
-#include "LogMacro.hpp"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cstring>
 
 namespace TCPDataTransfer {
-EpollConsumer::EpollConsumer(int consumerTag) : consumerTag_(consumerTag), epollFd_(-1), isRunning_(false) 
+namespace {
+const int MAX_EVENTS = 1024;
+const size_t COMMAND_QUEUE_RESERVE = 4096; // preallocated queue nodes, the queue grows past it when needed
+const size_t MAX_COMMANDS_PER_ROUND = 8192; // bounds how long socket events wait behind a command burst
+const size_t SPARE_COMMANDS = MAX_COMMANDS_PER_ROUND; // recycled SEND commands kept around, a full round fits
+const std::chrono::milliseconds LOAD_WINDOW(100); // busy time and hot connection are measured per window
+const std::chrono::seconds ZERO_COPY_LINGER(5); // closed sockets wait this long for zero copy completions before a reset
+const int64_t LINGER_POLL_US = 10000; // completions of closed sockets are polled, they left the reactor
+}
+
+EpollConsumer::EpollConsumer(int consumerTag, consumerOptions options)
+    : consumerTag_(consumerTag), backend_(options.backend), cpus_(std::move(options.cpus)), budget_(options.budget),
+      connectionTable_(options.connectionTable), connectTimeout_(options.connectTimeoutMs),
+      idleTimeout_(options.idleTimeoutMs), heartbeatInterval_(options.heartbeatIntervalMs), coalesceDelay_(options.coalesceDelayUs),
+      coalesceSegmentBytes_(options.coalesceSegmentBytes), coalesceFrameBytes_(options.coalesceFrameBytes), busyPoll_(options.busyPollUs),
+      socketBusyPollUs_(options.socketBusyPollUs), compactConnections_(options.compactConnections), wakeupFd_(-1), isRunning_(false),
+      commandQueue_(COMMAND_QUEUE_RESERVE), spareCommands_(SPARE_COMMANDS), bufferTuner_(options.socketBuffers)
 {
+    flushContext_.controlBurstBytes = options.controlBurstBytes;
+    if (options.bufferPool.maxBytes > 0) {
+        bufferPool_ = BufferPool::create(options.bufferPool, consumerTag_);
+    }
     LOG_INFO("EpollConsumer" << consumerTag_ << ", created");
     start();
 }
 
+EpollConsumer::~EpollConsumer()
+{
+    stop();
+    consumerCommand* command = nullptr;
+    while (commandQueue_.pop(command)) {
+        delete command;
+    }
+    while (spareCommands_.pop(command)) {
+        delete command;
+    }
+    for (auto& [fd, stash] : adoptionStash_) {
+        for (auto* stashed : stash.commands) {
+            delete stashed;
+        }
+    }
+    if (wakeupFd_ != -1) {
+        ::close(wakeupFd_);
+        wakeupFd_ = -1;
+    }
+}
+
 void EpollConsumer::start()
 {
-    epollFd_ = epoll_create1(0);
-    if (epollFd_ == -1) {
-        LOG_ERROR("EpollConsumer" << consumerTag_ << " failed to create epoll instance");
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupFd_ == -1) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << " failed to create wakeup eventfd: " << strerror(errno));
+        return;
+    }
+    reactor_ = Reactor::create(backend_, consumerTag_);
+    if (!reactor_) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << " failed to create reactor");
+        return;
+    }
+    if (!reactor_->add(wakeupFd_, EPOLLIN)) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << " failed to register wakeup eventfd: " << strerror(errno));
+        reactor_.reset();
         return;
     }
     isRunning_ = true;
     consumerThread_ = std::thread(&EpollConsumer::run, this);
-    LOG_INFO("EpollConsumer" << consumerTag_ << " started, thread id: " << consumerThread_.get_id());
+    pinThread();
+    LOG_INFO("EpollConsumer" << consumerTag_ << " started with " << reactor_->name() << " backend, thread id: " << consumerThread_.get_id());
 }
 
-bool EpollConsumer::addUserSocket(int socketFd, uint64_t userId)
+void EpollConsumer::pinThread()
 {
-    epoll_event event{};
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = socketFd;
-    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, socketFd, &event) == -1) {
-        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to add socket fd " << socketFd << ", for user " << userId);
+    if (cpus_.empty()) {
+        return;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus_) {
+        CPU_SET(cpu, &mask);
+    }
+    int ret = pthread_setaffinity_np(consumerThread_.native_handle(), sizeof(mask), &mask);
+    if (ret != 0) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << " failed to pin thread to " << cpus_.size() << " cpus starting at cpu "
+            << cpus_.front() << ": " << strerror(ret));
+        return;
+    }
+    LOG_INFO("EpollConsumer" << consumerTag_ << " pinned to " << cpus_.size() << " cpus starting at cpu " << cpus_.front());
+}
+
+void EpollConsumer::stop()
+{
+    isRunning_ = false;
+    wakeup();
+    if (consumerThread_.joinable()) {
+        consumerThread_.join();
+    }
+    reactor_.reset();
+    LOG_INFO("EpollConsumer" << consumerTag_ << " stopped");
+}
+
+bool EpollConsumer::submit(consumerCommand* command)
+{
+    if (!enqueue(command)) {
+        delete command;
         return false;
     }
-    {
-        std::unique_lock<std::shared_mutex> lock(lastEpollSocketStatusMapMutex_);
-        lastEpollSocketStatusMap_[socketFd] = event.events;
+    return true;
+}
+
+// the caller keeps the command when the push fails
+bool EpollConsumer::enqueue(consumerCommand* command)
+{
+    if (!commandQueue_.push(command)) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to enqueue command for socket fd " << command->socketFd);
+        return false;
     }
+    wakeup();
     return true;
 }
 
+// only the first producer after the consumer went to sleep pays for the eventfd write
+void EpollConsumer::wakeup()
+{
+    if (wakeupFd_ == -1 || wakeupPending_.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (::write(wakeupFd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to write wakeup eventfd: " << strerror(errno));
+    }
+}
+
+bool EpollConsumer::addUserSocket(int socketFd, uint64_t userId, bool connecting)
+{
+    if (!isRunning_) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << " is not running, cannot add socket fd " << socketFd);
+        return false;
+    }
+    auto* command = new consumerCommand{CommandType::ADD, socketFd, userId, {}, nullptr};
+    command->connecting = connecting;
+    if (!submit(command)) {
+        return false;
+    }
+    // counted right away so back to back assignments in the pool see it before the consumer runs
+    connections_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool EpollConsumer::removeUserSocket(int socketFd, uint64_t userId)
+{
+    return submit(new consumerCommand{CommandType::REMOVE, socketFd, userId, {}, nullptr});
+}
+
+// the copy is only made once the budgets took the bytes, a refused send costs no allocation
+SendResult EpollConsumer::sendData(int socketFd, uint64_t connId, const char* data, size_t len, SendPriority priority)
+{
+    auto result = chargeSend(socketFd, len);
+    if (result != SendResult::OK) {
+        return result;
+    }
+    return submitSend(socketFd, connId, bufferPool_ ? bufferPool_->copyOf(data, len) : PayloadBuffer::copyOf(data, len), priority);
+}
+
+SendResult EpollConsumer::sendData(int socketFd, uint64_t connId, const sendSpan* spans, size_t count, SendPriority priority)
+{
+    auto result = chargeSend(socketFd, PayloadBuffer::totalSize(spans, count));
+    if (result != SendResult::OK) {
+        return result;
+    }
+    return submitSend(socketFd, connId, bufferPool_ ? bufferPool_->copyOf(spans, count) : PayloadBuffer::copyOf(spans, count), priority);
+}
+
+SendResult EpollConsumer::sendData(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority)
+{
+    auto result = chargeSend(socketFd, data.size());
+    if (result != SendResult::OK) {
+        return result;
+    }
+    return submitSend(socketFd, connId, std::move(data), priority);
+}
+
+// bytes are charged here and credited by the consumer thread once they reached the kernel
+SendResult EpollConsumer::chargeSend(int socketFd, size_t len)
+{
+    auto consumerFits = [&] {
+        uint64_t queued = queuedBytes_.load(std::memory_order_seq_cst);
+        return queued == 0 || queued + len <= budget_.consumerHighWater;
+    };
+    if (!consumerFits()) {
+        consumerBlocked_.store(true, std::memory_order_seq_cst);
+        // the consumer may have drained below the mark before it could see the flag
+        if (!consumerFits()) {
+            if (connectionTable_) {
+                connectionTable_->markBlocked(socketFd);
+            }
+            return SendResult::OVER_LIMIT;
+        }
+    }
+    if (connectionTable_ && !connectionTable_->charge(socketFd, len, budget_.connHighWater)) {
+        return SendResult::WOULD_BLOCK;
+    }
+    queuedBytes_.fetch_add(len, std::memory_order_seq_cst);
+    return SendResult::OK;
+}
+
+// takes over the charge made by chargeSend, rolled back if the command cannot be queued
+SendResult EpollConsumer::submitSend(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority)
+{
+    size_t len = data.size();
+    consumerCommand* command = nullptr;
+    if (spareCommands_.pop(command)) {
+        *command = consumerCommand{CommandType::SEND, socketFd, connId, std::move(data), nullptr};
+    } else {
+        command = new consumerCommand{CommandType::SEND, socketFd, connId, std::move(data), nullptr};
+    }
+    command->priority = priority;
+    if (!submit(command)) {
+        queuedBytes_.fetch_sub(len, std::memory_order_seq_cst);
+        if (connectionTable_) {
+            connectionTable_->credit(socketFd, len, budget_.connLowWater);
+        }
+        return SendResult::FAILED;
+    }
+    return SendResult::OK;
+}
+
+SendResult EpollConsumer::sendFile(int socketFd, uint64_t connId, int fileFd, off_t offset, size_t len)
+{
+    struct stat st{};
+    if (fstat(fileFd, &st) < 0 || !S_ISREG(st.st_mode) || offset < 0 || static_cast<uint64_t>(offset) + len > static_cast<uint64_t>(st.st_size)) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", cannot send " << len << " bytes at offset " << offset << " of fd " << fileFd
+            << " on socket fd " << socketFd << ", not a regular file holding that range");
+        return SendResult::FAILED;
+    }
+    if (len == 0) {
+        return SendResult::OK;
+    }
+    int fd = fcntl(fileFd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to duplicate file fd " << fileFd << ": " << strerror(errno));
+        return SendResult::FAILED;
+    }
+    auto* command = new consumerCommand{CommandType::SEND_FILE, socketFd, connId, {}, nullptr};
+    command->file = std::make_unique<fileRange>(fd, offset, len);
+    return submit(command) ? SendResult::OK : SendResult::FAILED;
+}
+
+void EpollConsumer::setRecvCallback(RecvCallback callback)
+{
+    auto shared = callback ? std::make_shared<const RecvCallback>(std::move(callback)) : nullptr;
+    submit(new consumerCommand{CommandType::SET_CALLBACK, -1, 0, {}, std::move(shared)});
+}
+
+void EpollConsumer::setWritableCallback(WritableCallback callback)
+{
+    auto shared = callback ? std::make_shared<const WritableCallback>(std::move(callback)) : nullptr;
+    submit(new consumerCommand{CommandType::SET_WRITABLE_CALLBACK, -1, 0, {}, nullptr, nullptr, nullptr, std::move(shared)});
+}
+
+bool EpollConsumer::setConnRecvCallback(int socketFd, uint64_t connId, RecvCallback callback)
+{
+    auto shared = callback ? std::make_shared<const RecvCallback>(std::move(callback)) : nullptr;
+    return submit(new consumerCommand{CommandType::SET_CONN_CALLBACK, socketFd, connId, {}, std::move(shared)});
+}
+
+bool EpollConsumer::setConnCoalescing(int socketFd, uint64_t connId, bool enable)
+{
+    auto* command = new consumerCommand{CommandType::SET_COALESCING, socketFd, connId, {}, nullptr};
+    command->coalesce = enable;
+    return submit(command);
+}
+
+void EpollConsumer::setZeroCopyThreshold(size_t bytes)
+{
+    flushContext_.zeroCopyThreshold.store(bytes, std::memory_order_relaxed);
+    LOG_INFO("EpollConsumer" << consumerTag_ << ", zero copy threshold set to " << bytes << " bytes");
+}
+
+sendStats EpollConsumer::getSendStats() const
+{
+    return flushContext_.counters.snapshot();
+}
+
+consumerLoad EpollConsumer::getLoad() const
+{
+    consumerLoad load;
+    load.connections = connections_.load(std::memory_order_relaxed);
+    load.queuedBytes = queuedBytes_.load(std::memory_order_relaxed);
+    auto sinceWindow = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::nanoseconds(windowEndNs_.load(std::memory_order_relaxed));
+    if (sinceWindow > 2 * LOAD_WINDOW) {
+        return load; // no window finished lately, the consumer is sleeping in wait
+    }
+    load.busyPermille = busyPermille_.load(std::memory_order_relaxed);
+    load.windowBytes = windowBytes_.load(std::memory_order_relaxed);
+    load.hotFd = hotFd_.load(std::memory_order_relaxed);
+    load.hotConnId = hotConnId_.load(std::memory_order_relaxed);
+    load.hotBytes = hotBytes_.load(std::memory_order_relaxed);
+    return load;
+}
+
+bufferPoolStats EpollConsumer::getBufferPoolStats() const
+{
+    return bufferPool_ ? bufferPool_->stats() : bufferPoolStats{};
+}
+
+consumerMetrics EpollConsumer::getMetrics() const
+{
+    consumerMetrics metrics;
+    metrics.waits = metrics_.waits.load();
+    metrics.events = metrics_.events.load();
+    metrics.eventsPerWait = metrics_.eventsPerWait.snapshot();
+    metrics.loopNs = metrics_.loopNs.snapshot();
+    metrics.spinWaits = metrics_.spinWaits.load();
+    metrics.spinNs = metrics_.spinNs.load();
+    metrics.commands = metrics_.commands.load();
+    metrics.messagesQueued = metrics_.messagesQueued.load();
+    metrics.bytesSent = metrics_.bytesSent.load();
+    metrics.bytesReceived = metrics_.bytesReceived.load();
+    metrics.partialSends = metrics_.partialSends.load();
+    metrics.eagain = metrics_.eagain.load();
+    metrics.sendErrors = metrics_.sendErrors.load();
+    metrics.recvErrors = metrics_.recvErrors.load();
+    metrics.queuedBytes = queuedBytes_.load(std::memory_order_relaxed);
+    metrics.queuedEntries = metrics_.queuedEntries.load();
+    metrics.sndBufGrows = metrics_.sndBufGrows.load();
+    metrics.sndBufShrinks = metrics_.sndBufShrinks.load();
+    metrics.connections = connections_.load(std::memory_order_relaxed);
+    return metrics;
+}
+
+bool EpollConsumer::expectConnection(int socketFd, uint64_t connId)
+{
+    return submit(new consumerCommand{CommandType::EXPECT, socketFd, connId, {}, nullptr});
+}
+
+void EpollConsumer::cancelExpectedConnection(int socketFd, uint64_t connId)
+{
+    submit(new consumerCommand{CommandType::ADOPT, socketFd, connId, {}, nullptr});
+}
+
+bool EpollConsumer::migrateConnection(int socketFd, uint64_t connId, EpollConsumer* target)
+{
+    return submit(new consumerCommand{CommandType::MIGRATE, socketFd, connId, {}, nullptr, target});
+}
+
 void EpollConsumer::run()
 {
-    epoll_event events[1024];
+    epoll_event events[MAX_EVENTS];
+    bool backlog = false;
+    windowStart_ = now_ = std::chrono::steady_clock::now();
     while (isRunning_) {
-        int eventCount = epoll_wait(epollFd_, events, 1024, -1);
-        if (eventCount == 0) {
-            LOG_INFO("EpollConsumer" << consumerTag_ << ", epoll_wait timeout, normal situation");
-            continue; 
-        }
+        bool spin = updateSpinning();
+        auto spinStart = spin ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+        int eventCount = reactor_->wait(events, MAX_EVENTS, (backlog || spin) ? 0 : waitTimeoutUs());
+        auto roundStart = std::chrono::steady_clock::now();
+        now_ = roundStart;
         if (eventCount == -1) {
             if (errno == EINTR) {
-                continue; 
+                continue;
             }
-            LOG_ERROR("EpollConsumer" << consumerTag_ << ", epoll_wait error: " << strerror(errno));
-            sleep(1); 
+            LOG_ERROR("EpollConsumer" << consumerTag_ << ", " << reactor_->name() << " wait error: " << strerror(errno));
+            sleep(1);
             if (++errorCount_ >= 3) {
-                LOG_ERROR("EpollConsumer" << consumerTag_ << ", too many epoll_wait errors, restarting...");
-                errorCount_ = 0;
-                restartEpollConsumer();
-                return;
+                LOG_ERROR("EpollConsumer" << consumerTag_ << ", too many wait errors, rebuilding reactor...");
+                if (rebuildReactor()) {
+                    errorCount_ = 0;
+                }
             }
             continue;
         }
+        bool emptySpin = spin && eventCount == 0;
+        if (eventCount > 0) {
+            lastActivity_ = roundStart;
+        }
+        if (!emptySpin) {
+            metrics_.waits.add(1);
+            metrics_.events.add(static_cast<uint64_t>(eventCount));
+            metrics_.eventsPerWait.record(static_cast<uint64_t>(eventCount));
+        }
         for (int i = 0; i < eventCount; ++i) {
             int fd = events[i].data.fd;
             uint32_t eventFlags = events[i].events;
+            if (fd == wakeupFd_) {
+                uint64_t counter = 0;
+                while (::read(wakeupFd_, &counter, sizeof(counter)) < 0 && errno == EINTR) {
+                }
+                // commands pushed after this store write the eventfd again, unless the consumer spins and pops them anyway
+                wakeupPending_.store(spinning_);
+                continue;
+            }
+            connState* found = findConn(fd);
+            if (!found) {
+                continue; // closed earlier in this round
+            }
+            connState& conn = *found;
+            if (conn.connecting) {
+                if (!(eventFlags & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                    continue;
+                }
+                if (!finishConnect(fd, conn)) {
+                    closeSocket(fd);
+                    continue;
+                }
+            }
             if (eventFlags & EPOLLIN) {
-                LOG_INFO("EpollConsumer" << consumerTag_ << ", data available to read on fd " << fd);
-                // TODO: 收数据
-            }
-            if (eventFlags & EPOLLOUT) {
-                LOG_INFO("EpollConsumer" << consumerTag_ << ", ready to write on fd " << fd);
-                {
-                    std::lock_guard<std::mutex> lock(pendingDataMutex_);
-                    auto it = pendingDataMap_.find(fd);
-                    if (it == pendingDataMap_.end() || it->second.empty()) {
-                        modifiledEpollToJustListen(fd);
-                        continue;
-                    }
-                    bool allSent = true;
-                    for (auto& dataPair : it->second) {
-                        if (dataPair.allSent) {
-                            continue; 
-                        }
-                        const std::string& data = dataPair.data;
-                        size_t len = dataPair.len - dataPair.index;
-                        ssize_t bytesSent = ::send(fd, data.data() + dataPair.index, len, 0);
-                        if (bytesSent == -1) {
-                            LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to send data on fd " << fd << ": " << strerror(errno));
-                            allSent = false;
-                            continue; 
-                        }
-                        if (bytesSent < static_cast<ssize_t>(len)) {
-                            dataPair.index += bytesSent;
-                            LOG_INFO("EpollConsumer" << consumerTag_ << ", partial send " << bytesSent << " bytes on fd " << fd);
-                            allSent = false;
-                            continue; 
-                        }
-                        dataPair.allSent = true;
-                        LOG_INFO("EpollConsumer" << consumerTag_ << ", successfully sent ALL " << bytesSent << " bytes on fd " << fd);
-                    }
-                    if (allSent) {
-                        it->second.clear();
-                        modifiledEpollToJustListen(fd);
-                        pendingDataMap_.erase(it); 
-                    }
+                if (!handleReadable(fd, conn)) {
+                    dropConnection(fd, DisconnectReason::BROKEN);
+                    continue;
                 }
             }
-            if (eventFlags & (EPOLLHUP | EPOLLERR)) {
-                LOG_WARNING("EpollConsumer" << consumerTag_ << ", hang up or error on fd " << fd);
-                epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
-                ::close(fd);
+            // EPOLLOUT rides along with every other wakeup of a writable socket, only a blocked queue waits for it
+            if ((eventFlags & EPOLLOUT) && conn.writeBlocked) {
+                if (!handleWritable(fd, conn)) {
+                    dropConnection(fd, DisconnectReason::BROKEN);
+                    continue;
+                }
+            }
+            if (eventFlags & EPOLLERR) {
+                if (!handleError(fd, conn)) {
+                    LOG_WARNING("EpollConsumer" << consumerTag_ << ", error on fd " << fd);
+                    dropConnection(fd, DisconnectReason::BROKEN);
+                    continue;
+                }
             }
+            if (eventFlags & EPOLLHUP) {
+                LOG_WARNING("EpollConsumer" << consumerTag_ << ", hang up on fd " << fd);
+                dropConnection(fd, DisconnectReason::BROKEN);
+            }
+        }
+        backlog = processCommands();
+        if (consumerBlocked_.load(std::memory_order_seq_cst)) {
+            releaseConsumerBudget();
+        }
+        auto roundEnd = std::chrono::steady_clock::now();
+        now_ = roundEnd;
+        if (!delayedFlush_.empty()) {
+            flushDelayed();
+        }
+        wheel_.advance(roundEnd, [this](timerNode& timer) { onTimer(timer.socketFd); });
+        if (!lingering_.empty()) {
+            reapLingering(false);
+        }
+        auto loopEnd = std::chrono::steady_clock::now();
+        if (emptySpin) {
+            metrics_.spinWaits.add(1);
+            metrics_.spinNs.add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(loopEnd - spinStart).count()));
+        } else {
+            metrics_.loopNs.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(loopEnd - roundStart).count()));
+        }
+        busyInWindow_ += roundEnd - roundStart;
+        if (roundEnd - windowStart_ >= LOAD_WINDOW) {
+            rollLoadWindow(roundEnd);
+        }
+    }
+    // queued removals must still close their sockets
+    processCommands();
+    reapLingering(true);
+}
+
+/**
+ * Spins with zero timeout waits for busyPollUs after the last event or command. Spinning rounds pop the command
+ * queue anyway, so producers are spared the eventfd write meanwhile. Leaving the spin clears the flag and looks at
+ * the queue once more, commands pushed before that relied on the spin.
+ */
+bool EpollConsumer::updateSpinning()
+{
+    if (busyPoll_.count() == 0) {
+        return false;
+    }
+    bool spin = now_ - lastActivity_ < busyPoll_;
+    if (spinning_ && !spin) {
+        spinning_ = false;
+        wakeupPending_.store(false);
+        processCommands();
+        spin = now_ - lastActivity_ < busyPoll_;
+    }
+    if (spin && !spinning_) {
+        wakeupPending_.store(true);
+    }
+    spinning_ = spin;
+    return spin;
+}
+
+// the wheel's next due slot, the earliest coalesced flush and lingering sockets bound the wait, with none the consumer sleeps until an event
+int64_t EpollConsumer::waitTimeoutUs() const
+{
+    int timerMs = wheel_.timeoutMs(now_);
+    int64_t timerUs = timerMs < 0 ? -1 : static_cast<int64_t>(timerMs) * 1000;
+    if (!lingering_.empty()) {
+        timerUs = timerUs < 0 ? LINGER_POLL_US : std::min(timerUs, LINGER_POLL_US);
+    }
+    if (delayedFlush_.empty()) {
+        return timerUs;
+    }
+    int64_t flushUs = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(nextFlushDue_ - now_).count());
+    return timerUs < 0 ? flushUs : std::min(flushUs, timerUs);
+}
+
+void EpollConsumer::rollLoadWindow(std::chrono::steady_clock::time_point now)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - windowStart_).count();
+    uint32_t busy = elapsed > 0 ? static_cast<uint32_t>(busyInWindow_.count() * 1000 / elapsed) : 0;
+    busyPermille_.store(std::min<uint32_t>(busy, 1000), std::memory_order_relaxed);
+    windowBytes_.store(bytesInWindow_, std::memory_order_relaxed);
+    hotFd_.store(hotFdInWindow_, std::memory_order_relaxed);
+    hotConnId_.store(hotConnIdInWindow_, std::memory_order_relaxed);
+    hotBytes_.store(hotBytesInWindow_, std::memory_order_relaxed);
+    windowEndNs_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count(), std::memory_order_relaxed);
+    windowStart_ = now;
+    busyInWindow_ = std::chrono::nanoseconds(0);
+    bytesInWindow_ = 0;
+    hotFdInWindow_ = -1;
+    hotConnIdInWindow_ = INVALID_CONN_ID;
+    hotBytesInWindow_ = 0;
+    ++windowEpoch_;
+}
+
+bool EpollConsumer::finishConnect(int socketFd, connState& conn)
+{
+    int socketError = 0;
+    socklen_t errLen = sizeof(socketError);
+    if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, &socketError, &errLen) < 0) {
+        socketError = errno;
+    }
+    if (socketError != 0) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", connect failed on socket fd " << socketFd << ", for user " << conn.connId
+            << ": " << strerror(socketError));
+        reportConnect(socketFd, conn, socketError);
+        return false;
+    }
+    LOG_INFO("EpollConsumer" << consumerTag_ << ", connected socket fd " << socketFd << ", for user " << conn.connId);
+    reportConnect(socketFd, conn, 0);
+    conn.lastActive = conn.lastSent = now_;
+    armTimer(conn); // from the connect deadline to the heartbeat and idle ones
+    conn.writeBlocked = !conn.sendQueue.empty(); // sends queued during the connect go out with the EPOLLOUT that finished it
+    return true;
+}
+
+void EpollConsumer::reportConnect(int socketFd, connState& conn, int error)
+{
+    conn.connecting = false;
+    if (connectCallback_) {
+        connectCallback_(conn.connId, socketFd, error);
+    }
+}
 
+// lazily checked, traffic only moves the timestamps and the timer fires at the earliest deadline they allow
+void EpollConsumer::armTimer(connState& conn)
+{
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    // a connect in flight only answers to its own deadline, idleness and heartbeats count from the connect
+    if (conn.connecting) {
+        deadline = conn.connectDeadline;
+    } else {
+        if (heartbeatInterval_.count() > 0) {
+            deadline = conn.lastSent + heartbeatInterval_;
+        }
+        if (idleTimeout_.count() > 0) {
+            deadline = std::min(deadline, conn.lastActive + idleTimeout_);
         }
     }
-}  
+    if (budget_.slowConsumerTimeoutMs != 0 && conn.congestedSince != std::chrono::steady_clock::time_point{}) {
+        deadline = std::min(deadline, conn.congestedSince + std::chrono::milliseconds(budget_.slowConsumerTimeoutMs));
+    }
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+        wheel_.cancel(conn.timer);
+        return;
+    }
+    wheel_.schedule(conn.timer, deadline);
+}
 
-void EpollConsumer::modifiledEpollToJustListen(int socketFd)
+void EpollConsumer::onTimer(int socketFd)
 {
-    epoll_event event{};
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = socketFd;
-    if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, socketFd, &event) == -1) {
-        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to modify socket fd " << socketFd << " to just listen for EPOLLIN");
+    connState* found = findConn(socketFd);
+    if (!found) {
+        return;
+    }
+    connState& conn = *found;
+    if (conn.connecting && now_ >= conn.connectDeadline) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", connect timed out on socket fd " << socketFd << ", for user " << conn.connId
+            << " after " << connectTimeout_.count() << "ms");
+        reportConnect(socketFd, conn, ETIMEDOUT);
+        closeSocket(socketFd);
+        return;
+    }
+    if (budget_.slowConsumerTimeoutMs != 0 && conn.congestedSince != std::chrono::steady_clock::time_point{}
+        && now_ - conn.congestedSince >= std::chrono::milliseconds(budget_.slowConsumerTimeoutMs)) {
+        LOG_WARNING("EpollConsumer" << consumerTag_ << ", closing slow connection on socket fd " << socketFd << ", connId " << conn.connId
+            << ", " << conn.sendQueue.queuedBytes() << " bytes queued for more than " << budget_.slowConsumerTimeoutMs << "ms");
+        dropConnection(socketFd, DisconnectReason::SLOW_CONSUMER);
+        return;
+    }
+    if (idleTimeout_.count() > 0 && !conn.connecting && now_ - conn.lastActive >= idleTimeout_) {
+        LOG_WARNING("EpollConsumer" << consumerTag_ << ", closing idle connection on socket fd " << socketFd << ", connId " << conn.connId
+            << ", nothing received for " << idleTimeout_.count() << "ms");
+        dropConnection(socketFd, DisconnectReason::IDLE_TIMEOUT);
+        return;
+    }
+    if (heartbeatInterval_.count() > 0 && !conn.connecting && now_ - conn.lastSent >= heartbeatInterval_
+        && !sendHeartbeat(socketFd, conn)) {
+        dropConnection(socketFd, DisconnectReason::BROKEN);
+        return;
+    }
+    armTimer(conn);
+}
+
+// charged like any send so creditSent balances it once the frame reaches the kernel
+bool EpollConsumer::sendHeartbeat(int socketFd, connState& conn)
+{
+    static const PayloadBuffer heartbeat = PayloadBuffer::copyOf("\0\0\0\0", FRAME_HEADER_SIZE);
+    conn.lastSent = now_;
+    if (!conn.sendQueue.empty()) {
+        return true; // data is already on its way, it may only sit behind a full socket buffer
+    }
+    if (connectionTable_ && !connectionTable_->charge(socketFd, heartbeat.size(), budget_.connHighWater)) {
+        return true;
+    }
+    queuedBytes_.fetch_add(heartbeat.size(), std::memory_order_seq_cst);
+    conn.sendQueue.push(heartbeat, SendPriority::CONTROL);
+    metrics_.queuedEntries.add(1);
+    return conn.writeBlocked || handleWritable(socketFd, conn);
+}
+
+// the queue is written right away unless the socket is full or the bytes wait for coalescing, no reactor round trip
+bool EpollConsumer::queueSend(int socketFd, connState& conn, PayloadBuffer data, SendPriority priority)
+{
+    size_t entriesBefore = conn.sendQueue.size();
+    if (priority == SendPriority::CONTROL) {
+        conn.sendQueue.push(std::move(data), priority);
+    } else if (conn.coalesce && data.size() <= coalesceFrameBytes_) {
+        conn.sendQueue.pushCoalesced(std::move(data), coalesceSegmentBytes_);
     } else {
-        {
-            std::unique_lock<std::shared_mutex> lock(lastEpollSocketStatusMapMutex_);
-            lastEpollSocketStatusMap_[socketFd] = event.events;
+        conn.sendQueue.push(std::move(data));
+    }
+    metrics_.messagesQueued.add(1);
+    metrics_.queuedEntries.add(conn.sendQueue.size() - entriesBefore);
+    if (conn.sendQueue.queuedBytes() > budget_.connLowWater && conn.congestedSince == std::chrono::steady_clock::time_point{}) {
+        conn.congestedSince = now_;
+        armTimer(conn);
+    }
+    if (conn.connecting || conn.writeBlocked) {
+        return true; // the reactor flushes once the connect finished or the socket takes more
+    }
+    // control frames are never held back, they take the coalesced bytes ahead of them along
+    if (conn.coalesce && priority == SendPriority::BULK && conn.sendQueue.queuedBytes() < coalesceSegmentBytes_) {
+        if (conn.flushDue == std::chrono::steady_clock::time_point{}) {
+            conn.flushDue = now_ + coalesceDelay_;
+            delayedFlush_.push_back(socketFd);
         }
-        LOG_INFO("EpollConsumer" << consumerTag_ << ", successfully modified socket fd " << socketFd << " to just listen for EPOLLIN");
+        return true;
     }
-    {
-        std::lock_guard<std::mutex> lock(pendingDataMutex_);
-        pendingDataMap_.erase(socketFd);
+    return handleWritable(socketFd, conn);
+}
+
+// files never wait for coalescing, the bytes are already in the page cache and leave in large chunks anyway
+bool EpollConsumer::queueFile(int socketFd, connState& conn, std::unique_ptr<fileRange> file)
+{
+    conn.sendQueue.pushFile(std::move(file));
+    metrics_.messagesQueued.add(1);
+    metrics_.queuedEntries.add(1);
+    if (conn.connecting || conn.writeBlocked) {
+        return true;
     }
+    return handleWritable(socketFd, conn);
 }
 
-void EpollConsumer::restartEpollConsumer()
+// held back bytes go straight to the socket here, the reactor only resumes them when the socket buffer was full
+void EpollConsumer::flushDelayed()
 {
-    LOG_INFO("EpollConsumer" << consumerTag_ << " is restarting...");
-    stop();
-    start();
+    size_t kept = 0;
+    nextFlushDue_ = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 0; i < delayedFlush_.size(); ++i) {
+        int fd = delayedFlush_[i];
+        connState* conn = findConn(fd);
+        if (!conn || conn->flushDue == std::chrono::steady_clock::time_point{}) {
+            continue; // closed, moved away or flushed by the reactor meanwhile
+        }
+        bool full = conn->sendQueue.queuedBytes() >= coalesceSegmentBytes_;
+        if (now_ < conn->flushDue && !full && !conn->writeBlocked) {
+            nextFlushDue_ = std::min(nextFlushDue_, conn->flushDue);
+            delayedFlush_[kept++] = fd;
+            continue;
+        }
+        conn->flushDue = {};
+        if (!conn->writeBlocked && !handleWritable(fd, *conn)) {
+            dropConnection(fd, DisconnectReason::BROKEN);
+        }
+    }
+    delayedFlush_.resize(kept);
 }
 
-void EpollConsumer::stop()
+void EpollConsumer::notifyWritable(uint64_t connId)
 {
-    isRunning_ = false;
-    if (epollFd_ != -1) {
-        close(epollFd_);
-        epollFd_ = -1;
+    if (writableCallback_) {
+        (*writableCallback_)(connId);
     }
-    if (consumerThread_.joinable()) {
-        consumerThread_.join();
+}
+
+void EpollConsumer::creditSent(int socketFd, connState& conn, size_t bytes)
+{
+    queuedBytes_.fetch_sub(bytes, std::memory_order_seq_cst);
+    if (conn.sendQueue.queuedBytes() <= budget_.connLowWater) {
+        conn.congestedSince = {};
+    }
+    if (connectionTable_ && connectionTable_->credit(socketFd, bytes, budget_.connLowWater)) {
+        notifyWritable(conn.connId);
     }
-    LOG_INFO("EpollConsumer" << consumerTag_ << " stopped");
 }
 
-bool EpollConsumer::removeUserSocket(int socketFd, uint64_t userId)
+// connections refused with OVER_LIMIT only learn about it here, their own queue may have been empty all along
+void EpollConsumer::releaseConsumerBudget()
+{
+    if (queuedBytes_.load(std::memory_order_seq_cst) > budget_.consumerLowWater
+        || !consumerBlocked_.exchange(false, std::memory_order_seq_cst)) {
+        return;
+    }
+    if (!connectionTable_) {
+        return;
+    }
+    for (size_t fd = 0; fd < connStates_.size(); ++fd) {
+        auto& conn = connStates_[fd];
+        if (conn && connectionTable_->takeBlocked(static_cast<int>(fd), budget_.connLowWater)) {
+            notifyWritable(conn->connId);
+        }
+    }
+}
+
+void EpollConsumer::countTraffic(int socketFd, connState& conn, size_t bytes)
+{
+    if (conn.windowEpoch != windowEpoch_) {
+        conn.windowEpoch = windowEpoch_;
+        conn.windowBytes = 0;
+    }
+    conn.windowBytes += bytes;
+    bytesInWindow_ += bytes;
+    if (conn.windowBytes > hotBytesInWindow_) {
+        hotBytesInWindow_ = conn.windowBytes;
+        hotFdInWindow_ = socketFd;
+        hotConnIdInWindow_ = conn.connId;
+    }
+}
+
+// SEND commands go back to the producers, the payload is dropped here so the buffer returns to its pool right away
+void EpollConsumer::recycleCommand(consumerCommand* command)
+{
+    if (command->type != CommandType::SEND) {
+        delete command;
+        return;
+    }
+    *command = consumerCommand{};
+    if (!spareCommands_.bounded_push(command)) {
+        delete command;
+    }
+}
+
+bool EpollConsumer::processCommands()
+{
+    consumerCommand* command = nullptr;
+    size_t handled = 0;
+    while (handled < MAX_COMMANDS_PER_ROUND && commandQueue_.pop(command)) {
+        if (!stashForAdoption(command)) {
+            handleCommand(*command);
+            recycleCommand(command);
+        }
+        ++handled;
+    }
+    if (handled > 0) {
+        metrics_.commands.add(handled);
+        lastActivity_ = now_;
+    }
+    return handled == MAX_COMMANDS_PER_ROUND;
+}
+
+// commands routed here after a migration switched the route, but before the socket state arrived
+bool EpollConsumer::stashForAdoption(consumerCommand* command)
 {
-    if (epoll_ctl(epollFd_, EPOLL_CTL_DEL, socketFd, nullptr) == -1) {
-        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to remove socket fd " << socketFd << ", for user " << userId);
-        ::close(socketFd);
+    if (adoptionStash_.empty() || command->type == CommandType::ADD || command->type == CommandType::SET_CALLBACK
+        || command->type == CommandType::EXPECT || command->type == CommandType::ADOPT) {
         return false;
-    } 
-    LOG_INFO("EpollConsumer" << consumerTag_ << ", removed socket fd " << socketFd << ", for user " << userId);
-    ::close(socketFd);
-    {
-        std::lock_guard<std::mutex> lock(pendingDataMutex_);
-        pendingDataMap_.erase(socketFd);
     }
-    {
-        std::unique_lock<std::shared_mutex> lock(lastEpollSocketStatusMapMutex_);
-        lastEpollSocketStatusMap_.erase(socketFd);
+    auto it = adoptionStash_.find(command->socketFd);
+    if (it == adoptionStash_.end() || it->second.connId != command->connId) {
+        return false;
     }
+    it->second.commands.push_back(command);
     return true;
 }
 
-bool EpollConsumer::sendData(int socketFd, uint64_t connId, const char* data, size_t len)
+void EpollConsumer::adoptConnection(consumerCommand& command)
+{
+    int socketFd = command.socketFd;
+    std::vector<consumerCommand*> stashed;
+    auto it = adoptionStash_.find(socketFd);
+    if (it != adoptionStash_.end() && it->second.connId == command.connId) {
+        // commands behind a nested EXPECT belong to the next adoption, adoptions arrive in the order they were expected
+        auto& held = it->second.commands;
+        auto next = std::find_if(held.begin(), held.end(), [](consumerCommand* c) { return c->type == CommandType::EXPECT; });
+        stashed.assign(held.begin(), next);
+        if (next == held.end()) {
+            adoptionStash_.erase(it);
+        } else {
+            delete *next;
+            held.erase(held.begin(), next + 1);
+        }
+    }
+    if (!command.state) {
+        LOG_INFO("EpollConsumer" << consumerTag_ << ", connId " << command.connId << " on socket fd " << socketFd
+            << " did not migrate, dropping " << stashed.size() << " held commands");
+        for (auto* held : stashed) {
+            dropStashed(held);
+        }
+        return;
+    }
+    if (static_cast<size_t>(socketFd) >= connStates_.size()) {
+        connStates_.resize(static_cast<size_t>(socketFd) + 1);
+    }
+    auto& conn = connStates_[socketFd];
+    conn = std::move(command.state);
+    connections_.fetch_add(1, std::memory_order_relaxed);
+    queuedBytes_.fetch_add(conn->sendQueue.queuedBytes(), std::memory_order_relaxed);
+    metrics_.queuedEntries.add(conn->sendQueue.size());
+    if (!reactor_->add(socketFd, conn->events)) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to adopt socket fd " << socketFd << ", for user " << command.connId
+            << ": " << strerror(errno));
+        dropConnection(socketFd, DisconnectReason::BROKEN);
+    } else {
+        armTimer(*conn);
+        if (conn->flushDue != std::chrono::steady_clock::time_point{}) {
+            delayedFlush_.push_back(socketFd);
+        }
+        LOG_INFO("EpollConsumer" << consumerTag_ << ", adopted socket fd " << socketFd << ", for user " << command.connId
+            << " with " << conn->sendQueue.queuedBytes() << " bytes queued");
+    }
+    for (auto* held : stashed) {
+        handleCommand(*held);
+        delete held;
+    }
+}
+
+void EpollConsumer::handleCommand(consumerCommand& command)
+{
+    int socketFd = command.socketFd;
+    if (command.type == CommandType::SET_CALLBACK) {
+        recvCallback_ = std::move(command.callback);
+        return;
+    }
+    if (command.type == CommandType::SET_WRITABLE_CALLBACK) {
+        writableCallback_ = std::move(command.writableCallback);
+        return;
+    }
+    if (command.type == CommandType::EXPECT) {
+        auto it = adoptionStash_.find(socketFd);
+        if (it != adoptionStash_.end() && it->second.connId == command.connId) {
+            // moved back here before the earlier adoption arrived, a held MIGRATE takes it away again in between
+            it->second.commands.push_back(new consumerCommand{CommandType::EXPECT, socketFd, command.connId, {}, nullptr});
+            return;
+        }
+        if (it != adoptionStash_.end()) {
+            for (auto* held : it->second.commands) {
+                dropStashed(held);
+            }
+        }
+        adoptionStash_[socketFd] = adoptionStash{command.connId, {}};
+        return;
+    }
+    if (command.type == CommandType::ADOPT) {
+        adoptConnection(command);
+        return;
+    }
+    connState* found = findConn(socketFd);
+    if (command.type == CommandType::ADD) {
+        if (socketFd < 0) {
+            LOG_ERROR("EpollConsumer" << consumerTag_ << ", invalid socket fd " << socketFd << ", for user " << command.connId);
+            return;
+        }
+        if (found) {
+            LOG_WARNING("EpollConsumer" << consumerTag_ << ", socket fd " << socketFd << " re-added, dropping stale state of connId " << found->connId);
+            reactor_->remove(socketFd);
+            wheel_.cancel(found->timer);
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+            queuedBytes_.fetch_sub(found->sendQueue.queuedBytes(), std::memory_order_relaxed);
+            metrics_.queuedEntries.sub(found->sendQueue.size());
+        }
+        if (static_cast<size_t>(socketFd) >= connStates_.size()) {
+            connStates_.resize(static_cast<size_t>(socketFd) + 1);
+        }
+        auto& conn = connStates_[socketFd];
+        conn = std::make_unique<connState>(command.connId, bufferPool_.get());
+        // registered once, edge triggered EPOLLOUT stays quiet while the socket is writable and flushes go out inline
+        conn->events = EPOLLIN | EPOLLOUT | EPOLLET;
+        conn->timer.socketFd = socketFd;
+        conn->lastActive = conn->lastSent = now_;
+        if (command.connecting) {
+            // writability signals the end of the connect, successful or not
+            conn->connecting = true;
+            conn->connectDeadline = now_ + connectTimeout_;
+        }
+        if (socketBusyPollUs_ > 0) {
+            enableSocketBusyPoll(socketFd);
+        }
+        if (bufferTuner_.adaptive()) {
+            conn->sndBuf = bufferTuner_.setup(socketFd);
+        }
+        if (!reactor_->add(socketFd, conn->events)) {
+            int error = errno;
+            LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to add socket fd " << socketFd << ", for user " << command.connId
+                << ": " << strerror(error));
+            if (conn->connecting) {
+                reportConnect(socketFd, *conn, error);
+                closeSocket(socketFd);
+            } else {
+                dropConnection(socketFd, DisconnectReason::BROKEN);
+            }
+            return;
+        }
+        armTimer(*conn);
+        return;
+    }
+    // the fd number may already belong to a newer connection if this one was closed by the consumer
+    if (!found || found->connId != command.connId) {
+        LOG_DEBUG("EpollConsumer" << consumerTag_ << ", dropping command for closed socket fd " << socketFd << ", connId " << command.connId);
+        if (command.type == CommandType::MIGRATE) {
+            command.target->cancelExpectedConnection(socketFd, command.connId);
+        } else if (command.type == CommandType::SEND) {
+            dropSend(command);
+        }
+        return;
+    }
+    connState& conn = *found;
+    switch (command.type) {
+        case CommandType::REMOVE:
+            LOG_INFO("EpollConsumer" << consumerTag_ << ", removed socket fd " << socketFd << ", for user " << command.connId);
+            closeSocket(socketFd);
+            break;
+        case CommandType::SEND:
+            if (!queueSend(socketFd, conn, std::move(command.data), command.priority)) {
+                dropConnection(socketFd, DisconnectReason::BROKEN);
+            }
+            break;
+        case CommandType::SEND_FILE:
+            if (!queueFile(socketFd, conn, std::move(command.file))) {
+                dropConnection(socketFd, DisconnectReason::BROKEN);
+            }
+            break;
+        case CommandType::SET_COALESCING:
+            conn.coalesce = command.coalesce;
+            break;
+        case CommandType::SET_CONN_CALLBACK:
+            conn.callback = std::move(command.callback);
+            break;
+        case CommandType::MIGRATE: {
+            // commands routed here before the route switched are all ahead of MIGRATE, so the queue moves complete
+            reactor_->remove(socketFd);
+            wheel_.cancel(conn.timer); // the node is intrusive, the target re-arms it on its own wheel
+            auto state = std::move(connStates_[socketFd]);
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+            queuedBytes_.fetch_sub(state->sendQueue.queuedBytes(), std::memory_order_relaxed);
+            metrics_.queuedEntries.sub(state->sendQueue.size());
+            LOG_INFO("EpollConsumer" << consumerTag_ << ", migrating socket fd " << socketFd << ", for user " << command.connId
+                << " with " << state->sendQueue.queuedBytes() << " bytes queued");
+            auto* adopt = new consumerCommand{CommandType::ADOPT, socketFd, command.connId, {}, nullptr, nullptr, std::move(state)};
+            if (!command.target->enqueue(adopt)) {
+                state = std::move(adopt->state);
+                delete adopt;
+                keepConnection(socketFd, std::move(state), *command.target);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+bool EpollConsumer::rebuildReactor()
 {
-    LOG_INFO("EpollConsumer" << consumerTag_ << ", sendData called for socketFd " << socketFd << ", connId " << connId << ", data length " << len);
-    {
-        std::lock_guard<std::mutex> lock(pendingDataMutex_);
-        pendingDataMap_[socketFd].emplace_back(std::string(data), len);
+    auto reactor = Reactor::create(backend_, consumerTag_);
+    if (!reactor || !reactor->add(wakeupFd_, EPOLLIN)) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to rebuild reactor");
+        return false;
+    }
+    for (size_t fd = 0; fd < connStates_.size(); ++fd) {
+        if (connStates_[fd] && !reactor->add(static_cast<int>(fd), connStates_[fd]->events)) {
+            LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to re-register socket fd " << fd << " after rebuild");
+        }
     }
-    decltype(lastEpollSocketStatusMap_)::iterator it;
-    {
-        std::shared_lock<std::shared_mutex> lock(lastEpollSocketStatusMapMutex_);
-        it = lastEpollSocketStatusMap_.find(socketFd);
-        if (it != lastEpollSocketStatusMap_.end() && (it->second & EPOLLOUT)) {
-            LOG_INFO("EpollConsumer" << consumerTag_ << ", EPOLLOUT already set for socketFd " << socketFd);
+    // registering reports readiness that is already pending, the level triggered eventfd keeps any unread wakeup
+    reactor_ = std::move(reactor);
+    return true;
+}
+
+bool EpollConsumer::handleReadable(int socketFd, connState& conn)
+{
+    const auto& callback = conn.callback ? conn.callback : recvCallback_;
+    bool heartbeats = heartbeatInterval_.count() > 0;
+    auto onFrame = [&](const char* data, size_t len) {
+        if (len == 0 && heartbeats) {
+            return;
+        }
+        if (callback) {
+            (*callback)(conn.connId, data, len);
+        }
+    };
+    // edge triggered, keep reading until the kernel buffer is drained
+    while (true) {
+        if (!conn.recvBuffer.prepareWrite()) {
+            LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to allocate recv buffer for socket fd " << socketFd);
+            metrics_.recvErrors.add(1);
+            return false;
+        }
+        ssize_t bytesRead = ::recv(socketFd, conn.recvBuffer.writePtr(), conn.recvBuffer.writable(), 0);
+        if (bytesRead > 0) {
+            conn.recvBuffer.commit(static_cast<size_t>(bytesRead));
+            conn.lastActive = now_;
+            metrics_.bytesReceived.add(static_cast<uint64_t>(bytesRead));
+            countTraffic(socketFd, conn, static_cast<size_t>(bytesRead));
+            if (!conn.steered) {
+                checkIncomingCpu(socketFd, conn);
+            }
+            if (!conn.recvBuffer.decodeFrames(onFrame)) {
+                LOG_ERROR("EpollConsumer" << consumerTag_ << ", frame larger than " << MAX_FRAME_SIZE << " bytes on socket fd " << socketFd);
+                metrics_.recvErrors.add(1);
+                return false;
+            }
+            continue;
+        }
+        if (bytesRead == 0) {
+            LOG_INFO("EpollConsumer" << consumerTag_ << ", peer closed socket fd " << socketFd);
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (compactConnections_) {
+                conn.recvBuffer.release();
+            }
             return true;
         }
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to recv on fd " << socketFd << ": " << strerror(errno));
+        metrics_.recvErrors.add(1);
+        return false;
+    }
+}
+
+bool EpollConsumer::handleWritable(int socketFd, connState& conn)
+{
+    if (conn.sendQueue.hasZeroCopyInflight()) {
+        conn.sendQueue.reapCompletions(socketFd, flushContext_);
+    }
+    conn.flushDue = {}; // whatever coalesced bytes wait go out now
+    if (conn.sendQueue.empty()) {
+        conn.writeBlocked = false;
+        if (compactConnections_) {
+            conn.sendQueue.release();
+        }
+        return true;
+    }
+    size_t bytesSent = 0;
+    size_t queuedBefore = conn.sendQueue.queuedBytes();
+    size_t entriesBefore = conn.sendQueue.size();
+    auto result = conn.sendQueue.flush(socketFd, flushContext_, bytesSent);
+    size_t flushed = queuedBefore - conn.sendQueue.queuedBytes(); // buffered bytes only, file bytes were never charged
+    metrics_.bytesSent.add(bytesSent);
+    metrics_.queuedEntries.sub(entriesBefore - conn.sendQueue.size());
+    creditSent(socketFd, conn, flushed);
+    countTraffic(socketFd, conn, bytesSent);
+    if (bytesSent > 0) {
+        conn.lastSent = now_;
     }
-    epoll_event event{};
-    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
-    event.data.fd = socketFd;
-    if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, socketFd, &event) == -1) {
-        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to modify socket fd " << socketFd << " to add EPOLLOUT");
+    if (result == SendQueue::FlushResult::ERROR) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to send data on fd " << socketFd << ": " << strerror(errno));
+        metrics_.sendErrors.add(1);
         return false;
     }
-    {
-        std::unique_lock<std::shared_mutex> lock(lastEpollSocketStatusMapMutex_);
-        lastEpollSocketStatusMap_[socketFd] = event.events;
+    conn.writeBlocked = result == SendQueue::FlushResult::AGAIN;
+    if (compactConnections_ && result == SendQueue::FlushResult::DRAINED) {
+        conn.sendQueue.release(); // kept while zero copy sends are in flight, the EPOLLERR reaping them releases it
+    }
+    if (result == SendQueue::FlushResult::AGAIN) {
+        // counted instead of logged, the partial send path runs at message rate under load
+        if (bytesSent > 0) {
+            metrics_.partialSends.add(1);
+        } else {
+            metrics_.eagain.add(1);
+        }
+    }
+    if (conn.sndBuf > 0 && now_ >= conn.nextBufferSample) {
+        retuneSendBuffer(socketFd, conn);
+    }
+    return true;
+}
+
+// only connections that move data are sampled, an idle socket's buffer holds nothing whatever its size
+void EpollConsumer::retuneSendBuffer(int socketFd, connState& conn)
+{
+    tcpSample sample;
+    if (!SocketBufferTuner::sample(socketFd, sample)) {
+        conn.sndBuf = 0; // not TCP after all, stop sampling it
+        return;
+    }
+    uint32_t sndBuf = bufferTuner_.retune(socketFd, conn.sndBuf, sample, conn.writeBlocked);
+    if (sndBuf > conn.sndBuf) {
+        metrics_.sndBufGrows.add(1);
+    } else if (sndBuf < conn.sndBuf) {
+        metrics_.sndBufShrinks.add(1);
+    }
+    conn.sndBuf = sndBuf;
+    conn.nextBufferSample = now_ + std::chrono::microseconds(bufferTuner_.sampleIntervalUs(sample));
+}
+
+// EPOLLERR is also raised while MSG_ZEROCOPY completions sit in the error queue, only SO_ERROR means a broken socket
+bool EpollConsumer::handleError(int socketFd, connState& conn)
+{
+    if (conn.sendQueue.hasZeroCopyInflight()) {
+        conn.sendQueue.reapCompletions(socketFd, flushContext_);
+        if (compactConnections_) {
+            conn.sendQueue.release();
+        }
+    }
+    int socketError = 0;
+    socklen_t errLen = sizeof(socketError);
+    if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, &socketError, &errLen) < 0 || socketError != 0) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", socket fd " << socketFd << " error: " << strerror(socketError));
+        return false;
     }
-    LOG_INFO("EpollConsumer" << consumerTag_ << ", successfully EPOLLOUT added for socketFd " << socketFd);
     return true;
 }
-}
\ No newline at end of file
+
+// raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN, once refused the consumer stops asking
+void EpollConsumer::enableSocketBusyPoll(int socketFd)
+{
+    int usecs = static_cast<int>(socketBusyPollUs_);
+    if (setsockopt(socketFd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+        LOG_WARNING("EpollConsumer" << consumerTag_ << ", SO_BUSY_POLL " << usecs << "us refused on socket fd " << socketFd
+            << ": " << strerror(errno) << ", not setting it again");
+        socketBusyPollUs_ = 0;
+    }
+}
+
+// the CPU is only known once packets arrived, so this runs on the first successful read
+void EpollConsumer::checkIncomingCpu(int socketFd, connState& conn)
+{
+    conn.steered = true;
+    if (!steerCallback_ || cpus_.empty()) {
+        return;
+    }
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(socketFd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0) {
+        return;
+    }
+    if (std::find(cpus_.begin(), cpus_.end(), cpu) == cpus_.end()) {
+        steerCallback_(socketFd, conn.connId, cpu);
+    }
+}
+
+/**
+ * A migration whose ADOPT could not be queued: the state comes back, the route points here again and the target
+ * drops what it held for the connection. Commands that reached the target meanwhile are lost and credited there.
+ */
+void EpollConsumer::keepConnection(int socketFd, std::unique_ptr<connState> state, EpollConsumer& target)
+{
+    uint64_t connId = state->connId;
+    LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to hand socket fd " << socketFd << " for user " << connId
+        << " to EpollConsumer" << target.consumerTag_ << ", keeping it");
+    auto& conn = connStates_[socketFd];
+    conn = std::move(state);
+    connections_.fetch_add(1, std::memory_order_relaxed);
+    queuedBytes_.fetch_add(conn->sendQueue.queuedBytes(), std::memory_order_relaxed);
+    metrics_.queuedEntries.add(conn->sendQueue.size());
+    if (connectionTable_) {
+        connectionTable_->reroute(socketFd, connId, static_cast<uint16_t>(consumerTag_));
+    }
+    target.cancelExpectedConnection(socketFd, connId);
+    if (!reactor_->add(socketFd, conn->events)) {
+        LOG_ERROR("EpollConsumer" << consumerTag_ << ", failed to re-add socket fd " << socketFd << ", for user " << connId
+            << ": " << strerror(errno));
+        dropConnection(socketFd, DisconnectReason::BROKEN);
+        return;
+    }
+    armTimer(*conn);
+    if (conn->flushDue != std::chrono::steady_clock::time_point{}) {
+        delayedFlush_.push_back(socketFd);
+    }
+}
+
+// held commands of a connection that will not arrive, a held MIGRATE releases the consumer expecting it in turn
+void EpollConsumer::dropStashed(consumerCommand* command)
+{
+    if (command->type == CommandType::SEND) {
+        dropSend(*command);
+    } else if (command->type == CommandType::MIGRATE) {
+        command->target->cancelExpectedConnection(command->socketFd, command->connId);
+    }
+    delete command;
+}
+
+// a charged SEND that never reached a queue, the slot is only credited while it still belongs to that connection
+void EpollConsumer::dropSend(const consumerCommand& command)
+{
+    size_t bytes = command.data.size();
+    queuedBytes_.fetch_sub(bytes, std::memory_order_seq_cst);
+    uint16_t owner = 0;
+    if (connectionTable_ && connectionTable_->lookup(command.socketFd, command.connId, owner)
+        && connectionTable_->credit(command.socketFd, bytes, budget_.connLowWater)) {
+        notifyWritable(command.connId);
+    }
+}
+
+// closes the consumer decided on, the owner hears about them while the fd number is still held
+void EpollConsumer::dropConnection(int socketFd, DisconnectReason reason)
+{
+    connState& conn = *connStates_[socketFd];
+    if (conn.connecting) {
+        // only the slow consumer timer closes a connect in flight, it never got to be a connection
+        reportConnect(socketFd, conn, ETIMEDOUT);
+    } else if (disconnectCallback_) {
+        disconnectCallback_(conn.connId, socketFd, reason);
+    }
+    closeSocket(socketFd);
+}
+
+void EpollConsumer::closeSocket(int socketFd)
+{
+    auto& conn = connStates_[socketFd];
+    reactor_->remove(socketFd);
+    wheel_.cancel(conn->timer);
+    queuedBytes_.fetch_sub(conn->sendQueue.queuedBytes(), std::memory_order_relaxed);
+    metrics_.queuedEntries.sub(conn->sendQueue.size());
+    connections_.fetch_sub(1, std::memory_order_relaxed);
+    if (conn->sendQueue.hasZeroCopyInflight()) {
+        // the payloads go back to the pool only once the kernel released them, the open fd also keeps its number from reuse
+        ::shutdown(socketFd, SHUT_RDWR);
+        lingering_.push_back({socketFd, std::move(conn), now_ + ZERO_COPY_LINGER});
+        return;
+    }
+    ::close(socketFd);
+    conn.reset();
+}
+
+/**
+ * Closes lingering sockets whose zero copy sends completed. Past the deadline, or with abort, the socket is reset
+ * instead, which drops its unsent data so the kernel lets go of the payloads.
+ */
+void EpollConsumer::reapLingering(bool abort)
+{
+    auto it = lingering_.begin();
+    while (it != lingering_.end()) {
+        auto& queue = it->state->sendQueue;
+        queue.reapCompletions(it->socketFd, flushContext_);
+        if (queue.hasZeroCopyInflight()) {
+            if (!abort && now_ < it->deadline) {
+                ++it;
+                continue;
+            }
+            LOG_WARNING("EpollConsumer" << consumerTag_ << ", resetting closed socket fd " << it->socketFd
+                << " with zero copy sends still in flight");
+            linger reset{1, 0};
+            setsockopt(it->socketFd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        }
+        ::close(it->socketFd);
+        it = lingering_.erase(it);
+    }
+}
+}
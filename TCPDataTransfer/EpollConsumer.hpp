@@ -2,44 +2,353 @@
 
 #include <atomic>
 #include <thread>
-#include <map>
+#include <memory>
 #include <vector>
 #include <string>
-#include <mutex>
 #include <chrono>
-#include <shared_mutex>
+#include <unordered_map>
+#include <functional>
+#include "boost/lockfree/queue.hpp"
+#include "boost/lockfree/stack.hpp"
+#include "RecvBuffer.hpp"
+#include "SendQueue.hpp"
+#include "Reactor.hpp"
+#include "ConnectionTable.hpp"
+#include "TimingWheel.hpp"
+#include "ConsumerMetrics.hpp"
+#include "BufferPool.hpp"
+#include "SocketBufferTuner.hpp"
 
 namespace TCPDataTransfer {
-struct pendingData {
-    std::string data;
-    size_t len;
-    size_t index{0};
-    bool allSent{false};
-    pendingData(const std::string& d, size_t l) : data(d), len(l) {}
+/**
+ * Everything the consumer knows about one socket, only ever touched by the consumer thread.
+ */
+struct connState {
+    uint64_t connId;
+    uint32_t events{0}; // interest registered in the reactor, EPOLLOUT stays on for the connection's lifetime
+    bool writeBlocked{false}; // the last flush hit a full socket buffer, the next edge triggered EPOLLOUT resumes it
+    SendQueue sendQueue;
+    RecvBuffer recvBuffer;
+    std::shared_ptr<const RecvCallback> callback; // overrides the consumer wide callback when set
+    uint64_t windowBytes{0}; // bytes moved during loadWindow, used to pick the hot connection
+    uint32_t windowEpoch{0};
+    bool steered{false}; // SO_INCOMING_CPU already checked
+    std::chrono::steady_clock::time_point congestedSince{}; // queue above the low water mark since, epoch when not
+    bool connecting{false}; // non-blocking connect still in flight, finished by the first EPOLLOUT
+    std::chrono::steady_clock::time_point connectDeadline{};
+    std::chrono::steady_clock::time_point lastActive{}; // last bytes received, or when the connection was added
+    std::chrono::steady_clock::time_point lastSent{};   // last bytes handed to the kernel or heartbeat queued
+    timerNode timer; // armed for the earliest of the deadlines above, which are re-checked when it fires
+    bool coalesce{false}; // small frames are packed into segments and held back up to coalesceDelayUs
+    std::chrono::steady_clock::time_point flushDue{}; // coalesced bytes wait for the flush due then, epoch when none
+    uint32_t sndBuf{0}; // SO_SNDBUF set by the adaptive tuner, 0 when the socket keeps the size it came with
+    std::chrono::steady_clock::time_point nextBufferSample{};
+    explicit connState(uint64_t id, BufferPool* pool = nullptr) : connId(id), sendQueue(pool), recvBuffer(RECV_BUFFER_SIZE, pool) {}
 };
+
+/**
+ * Live load of one consumer. busyPermille and the hot connection describe the last finished load
+ * window, they read as idle when the consumer slept through the previous windows.
+ */
+struct consumerLoad {
+    uint32_t connections{0};
+    uint64_t queuedBytes{0};
+    uint32_t busyPermille{0}; // share of the window spent outside the reactor wait
+    uint64_t windowBytes{0};  // bytes received and sent by all connections during the window
+    int hotFd{-1};            // connection that moved the most bytes during the window
+    uint64_t hotConnId{INVALID_CONN_ID};
+    uint64_t hotBytes{0};
+};
+
+enum class SendResult {
+    OK,
+    WOULD_BLOCK,   // the connection is above its high water mark, retry after the writable callback
+    OVER_LIMIT,    // the consumer as a whole is above its byte budget, retry after the writable callback
+    NOT_CONNECTED, // unknown connection or consumer not running
+    FAILED         // the command could not be queued
+};
+
+/**
+ * Called on the consumer thread once a connection that was refused with WOULD_BLOCK or OVER_LIMIT
+ * drained below the low water marks again.
+ */
+using WritableCallback = std::function<void(uint64_t connId)>;
+
+/**
+ * Called on the consumer thread when a connection added as connecting finished its connect, error is 0 on
+ * success, the socket error, ETIMEDOUT or the errno of a failed reactor registration otherwise. Failed sockets
+ * are closed once the callback returns, so socketFd cannot belong to another connection while it runs.
+ */
+using ConnectCallback = std::function<void(uint64_t connId, int socketFd, int error)>;
+
+enum class DisconnectReason {
+    BROKEN,        // the peer closed the connection, or a read, write or socket error, heartbeats included
+    SLOW_CONSUMER, // the send queue stayed above connLowWater for slowConsumerTimeoutMs
+    IDLE_TIMEOUT   // nothing was received for idleTimeoutMs
+};
+
+/**
+ * Called on the consumer thread when the consumer closes a connection on its own. Neither removeUserSocket nor a
+ * failed connect, which the connect callback reports, end up here. The socket is closed once the callback returns,
+ * so socketFd still belongs to connId while it runs.
+ */
+using DisconnectCallback = std::function<void(uint64_t connId, int socketFd, DisconnectReason reason)>;
+
+/**
+ * Bytes accepted by sendData but not yet handed to the kernel. Above a high water mark sends are refused
+ * until the queue drains below the matching low water mark.
+ */
+struct sendBudget {
+    size_t connHighWater{4 << 20};
+    size_t connLowWater{1 << 20};
+    size_t consumerHighWater{256 << 20};
+    size_t consumerLowWater{128 << 20};
+    uint32_t slowConsumerTimeoutMs{30000}; // connections that stay above connLowWater this long are closed, 0 never closes
+};
+
+struct consumerOptions {
+    ReactorBackend backend{ReactorBackend::EPOLL};
+    std::vector<int> cpus; // CPUs the consumer thread is pinned to, empty leaves it to the scheduler
+    sendBudget budget;
+    ConnectionTable* connectionTable{nullptr}; // holds the per connection budgets, without it only the consumer budget applies
+    uint32_t connectTimeoutMs{5000}; // connecting sockets that are not established by then fail with ETIMEDOUT
+    uint32_t idleTimeoutMs{0}; // connections that receive nothing for this long are closed, 0 never closes
+    /**
+     * An empty frame (a zero length header) is queued on connections that sent nothing for this long, 0 disables it.
+     * Inbound empty frames are then taken as heartbeats and not handed to the recv callback.
+     * Heartbeats only go out while the send queue is empty, so every sendData must carry whole frames.
+     */
+    uint32_t heartbeatIntervalMs{0};
+    /**
+     * Connections that opted into coalescing copy frames up to coalesceFrameBytes into send segments and
+     * flush once a segment holds coalesceSegmentBytes or the oldest frame waited coalesceDelayUs.
+     */
+    uint32_t coalesceDelayUs{200};
+    size_t coalesceSegmentBytes{16 << 10};
+    size_t coalesceFrameBytes{512};
+    size_t controlBurstBytes{64 << 10}; // control bytes sent ahead of waiting bulk data before one bulk payload goes through
+    /**
+     * After an event or command the consumer keeps polling with zero timeout for this long before it blocks again,
+     * trading a busy CPU for the wakeup latency. 0 always blocks. spinNs and loopNs in the metrics show the split.
+     */
+    uint32_t busyPollUs{0};
+    uint32_t socketBusyPollUs{0}; // SO_BUSY_POLL set on every added socket, 0 leaves it alone
+    /**
+     * Copies made by sendData(const char*), receive buffers and send queue storage come from this consumer's pool.
+     * Blocks are released from any thread, so payloads may outlive the connection or the consumer.
+     */
+    bufferPoolOptions bufferPool;
+    socketBufferOptions socketBuffers; // adaptive SO_SNDBUF sizing, sockets keep their own size unless enabled
+    /**
+     * For many mostly idle connections: receive buffers go back to the pool once a read leaves no partial frame,
+     * send lanes once the queue drained. Busy connections then take them from the pool again for every burst.
+     */
+    bool compactConnections{false};
+};
+
+class EpollConsumer;
+
+/**
+ * Called on the consumer thread when a connection's packets arrive on a CPU the consumer is not pinned to.
+ */
+using SteerCallback = std::function<void(int socketFd, uint64_t connId, int cpu)>;
+
+enum class CommandType { ADD, REMOVE, SEND, SET_CONN_CALLBACK, SET_CALLBACK, SET_WRITABLE_CALLBACK, EXPECT, MIGRATE, ADOPT, SET_COALESCING, SEND_FILE };
+
+/**
+ * Request handed from any thread to the consumer thread through the submission queue.
+ */
+struct consumerCommand {
+    CommandType type;
+    int socketFd;
+    uint64_t connId;
+    PayloadBuffer data;
+    std::shared_ptr<const RecvCallback> callback;
+    EpollConsumer* target{nullptr};     // MIGRATE only
+    std::unique_ptr<connState> state{}; // ADOPT only, null when the connection died before it could move
+    std::shared_ptr<const WritableCallback> writableCallback{};
+    bool connecting{false}; // ADD only, the socket has a non-blocking connect in progress
+    bool coalesce{false};   // SET_COALESCING only
+    SendPriority priority{SendPriority::BULK}; // SEND only
+    std::unique_ptr<fileRange> file{};         // SEND_FILE only
+};
+
 class EpollConsumer {
 public:
-    explicit EpollConsumer(int consumerTag);
+    explicit EpollConsumer(int consumerTag, consumerOptions options = consumerOptions());
     ~EpollConsumer();
 
     void stop();
-    bool addUserSocket(int socketFd, uint64_t userId);
+    /**
+     * The methods below only enqueue a command for the consumer thread, they never touch the socket
+     * or block on the consumer. Failures found later by the consumer are logged, the socket is closed and
+     * reported through the disconnect callback.
+     */
+    /**
+     * @param connecting the socket's non-blocking connect returned EINPROGRESS, the consumer finishes it
+     * and reports the outcome through the connect callback. Sends queued meanwhile go out once connected.
+     */
+    bool addUserSocket(int socketFd, uint64_t userId, bool connecting = false);
     bool removeUserSocket(int socketFd, uint64_t userId);
-    bool sendData(int socketFd, uint64_t connId, const char* data, size_t len);
+    SendResult sendData(int socketFd, uint64_t connId, const char* data, size_t len, SendPriority priority = SendPriority::BULK);
+    SendResult sendData(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority = SendPriority::BULK);
+    /**
+     * Gathers the spans into one pooled buffer queued as a single message, it leaves in one piece of the stream.
+     */
+    SendResult sendData(int socketFd, uint64_t connId, const sendSpan* spans, size_t count, SendPriority priority = SendPriority::BULK);
+    /**
+     * Streams len bytes of a regular file from offset with sendfile, in order with the BULK data around it.
+     * The descriptor is duplicated, fileFd may be closed once this returns. File bytes are not charged to the
+     * send budgets since they take no memory while queued. FAILED for anything but a regular file holding the range.
+     */
+    SendResult sendFile(int socketFd, uint64_t connId, int fileFd, off_t offset, size_t len);
+    void setRecvCallback(RecvCallback callback);
+    void setWritableCallback(WritableCallback callback);
+    bool setConnRecvCallback(int socketFd, uint64_t connId, RecvCallback callback);
+    bool setConnCoalescing(int socketFd, uint64_t connId, bool enable);
+    void setZeroCopyThreshold(size_t bytes);
+    sendStats getSendStats() const;
+    consumerLoad getLoad() const;
+    /**
+     * Relaxed reads of counters the consumer thread keeps, fields may be a round apart from each other.
+     */
+    consumerMetrics getMetrics() const;
+    /**
+     * Occupancy of the consumer's buffer pool, empty when the pool is disabled.
+     */
+    bufferPoolStats getBufferPoolStats() const;
+    /**
+     * Live migration, driven by EpollConsumerPool. The target is told to expect the connection first and
+     * holds back commands routed to it until the source hands over the socket state with its queued data.
+     */
+    bool expectConnection(int socketFd, uint64_t connId);
+    void cancelExpectedConnection(int socketFd, uint64_t connId);
+    bool migrateConnection(int socketFd, uint64_t connId, EpollConsumer* target);
+    /**
+     * Must be set before the first addUserSocket, only pinned consumers report connections.
+     */
+    void setSteerCallback(SteerCallback callback) { steerCallback_ = std::move(callback); }
+    void setConnectCallback(ConnectCallback callback) { connectCallback_ = std::move(callback); }
+    void setDisconnectCallback(DisconnectCallback callback) { disconnectCallback_ = std::move(callback); }
+    const std::vector<int>& cpus() const { return cpus_; }
 private:
+    struct adoptionStash {
+        uint64_t connId;
+        std::vector<consumerCommand*> commands;
+    };
+
+    // closed connection whose MSG_ZEROCOPY payloads the kernel may still read, kept open until their completions arrive
+    struct lingeringSocket {
+        int socketFd;
+        std::unique_ptr<connState> state;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
     void start();
     void run();
-    void restartEpollConsumer();
-    void modifiledEpollToJustListen(int socketFd);
+    bool submit(consumerCommand* command);
+    bool enqueue(consumerCommand* command);
+    SendResult chargeSend(int socketFd, size_t len);
+    SendResult submitSend(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority);
+    bool stashForAdoption(consumerCommand* command);
+    void adoptConnection(consumerCommand& command);
+    void countTraffic(int socketFd, connState& conn, size_t bytes);
+    void rollLoadWindow(std::chrono::steady_clock::time_point now);
+    void pinThread();
+    void checkIncomingCpu(int socketFd, connState& conn);
+    void creditSent(int socketFd, connState& conn, size_t bytes);
+    void releaseConsumerBudget();
+    void notifyWritable(uint64_t connId);
+    bool finishConnect(int socketFd, connState& conn);
+    void reportConnect(int socketFd, connState& conn, int error);
+    void armTimer(connState& conn);
+    void onTimer(int socketFd);
+    bool sendHeartbeat(int socketFd, connState& conn);
+    bool queueSend(int socketFd, connState& conn, PayloadBuffer data, SendPriority priority);
+    bool queueFile(int socketFd, connState& conn, std::unique_ptr<fileRange> file);
+    void flushDelayed();
+    int64_t waitTimeoutUs() const;
+    bool updateSpinning();
+    void enableSocketBusyPoll(int socketFd);
+    void retuneSendBuffer(int socketFd, connState& conn);
+    void wakeup();
+    bool processCommands();
+    void recycleCommand(consumerCommand* command);
+    void handleCommand(consumerCommand& command);
+    bool rebuildReactor();
+    bool handleReadable(int socketFd, connState& conn);
+    bool handleWritable(int socketFd, connState& conn);
+    bool handleError(int socketFd, connState& conn);
+    void keepConnection(int socketFd, std::unique_ptr<connState> state, EpollConsumer& target);
+    void dropStashed(consumerCommand* command);
+    void dropSend(const consumerCommand& command);
+    void dropConnection(int socketFd, DisconnectReason reason);
+    void closeSocket(int socketFd);
+    void reapLingering(bool abort);
+    connState* findConn(int socketFd)
+    {
+        if (socketFd < 0 || static_cast<size_t>(socketFd) >= connStates_.size()) {
+            return nullptr;
+        }
+        return connStates_[socketFd].get();
+    }
 private:
     int consumerTag_;
-    int epollFd_;
+    ReactorBackend backend_;
+    std::vector<int> cpus_;
+    sendBudget budget_;
+    ConnectionTable* connectionTable_;
+    SteerCallback steerCallback_;
+    ConnectCallback connectCallback_;
+    DisconnectCallback disconnectCallback_;
+    std::chrono::milliseconds connectTimeout_;
+    std::chrono::milliseconds idleTimeout_;
+    std::chrono::milliseconds heartbeatInterval_;
+    std::chrono::microseconds coalesceDelay_;
+    size_t coalesceSegmentBytes_;
+    size_t coalesceFrameBytes_;
+    std::chrono::microseconds busyPoll_;
+    uint32_t socketBusyPollUs_;
+    bool compactConnections_;
+    bool spinning_{false};
+    std::chrono::steady_clock::time_point lastActivity_{}; // last round with an event or a command
+    std::unique_ptr<Reactor> reactor_;
+    int wakeupFd_;
+    std::atomic_bool wakeupPending_{false};
     std::atomic_bool isRunning_;
     std::atomic_int32_t errorCount_{0};
     std::thread consumerThread_;
-    std::map<int, std::vector<pendingData>> pendingDataMap_; 
-    std::mutex pendingDataMutex_;
-    std::map<int, uint32_t> lastEpollSocketStatusMap_;
-    std::shared_mutex lastEpollSocketStatusMapMutex_;
+    std::unique_ptr<BufferPool, BufferPool::retirer> bufferPool_; // outlives connStates_, retiring waits for blocks still out
+    boost::lockfree::queue<consumerCommand*> commandQueue_;
+    boost::lockfree::stack<consumerCommand*> spareCommands_; // handled SEND commands, reused by the next sendData
+    std::vector<std::unique_ptr<connState>> connStates_; // indexed by socket fd, grows to the highest fd added
+    std::shared_ptr<const RecvCallback> recvCallback_;
+    std::shared_ptr<const WritableCallback> writableCallback_;
+    std::atomic_bool consumerBlocked_{false}; // a send was refused with OVER_LIMIT since the last release
+    TimingWheel wheel_; // one timer per connection, connect and slow consumer deadlines, idle eviction and heartbeats
+    std::chrono::steady_clock::time_point now_; // taken once per round, stamps lastActive and lastSent
+    std::vector<int> delayedFlush_; // coalescing connections holding bytes back until their flushDue
+    std::chrono::steady_clock::time_point nextFlushDue_{}; // earliest flushDue left after the last flushDelayed
+    flushContext flushContext_;
+    SocketBufferTuner bufferTuner_;
+    consumerCounters metrics_;
+    std::unordered_map<int, adoptionStash> adoptionStash_; // connections announced by EXPECT, keyed by fd, a repeated EXPECT is held as a marker
+    std::vector<lingeringSocket> lingering_;
+    // load, written by the consumer thread, except connections_ and queuedBytes_ which the producers charge up front
+    std::atomic<uint32_t> connections_{0};
+    std::atomic<uint64_t> queuedBytes_{0};
+    std::atomic<uint32_t> busyPermille_{0};
+    std::atomic<uint64_t> windowBytes_{0};
+    std::atomic<int> hotFd_{-1};
+    std::atomic<uint64_t> hotConnId_{INVALID_CONN_ID};
+    std::atomic<uint64_t> hotBytes_{0};
+    std::atomic<int64_t> windowEndNs_{0};
+    std::chrono::steady_clock::time_point windowStart_;
+    std::chrono::nanoseconds busyInWindow_{0};
+    uint64_t bytesInWindow_{0};
+    uint32_t windowEpoch_{1};
+    int hotFdInWindow_{-1};
+    uint64_t hotConnIdInWindow_{INVALID_CONN_ID};
+    uint64_t hotBytesInWindow_{0};
 };
-}
\ No newline at end of file
+}
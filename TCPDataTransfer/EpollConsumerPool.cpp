@@ -1,104 +1,458 @@
 #include "EpollConsumerPool.hpp"
 #include "ConnectionDef.hpp"
 #include "LogMacro.hpp"
+#include <sys/socket.h>
+#include <algorithm>
 
 namespace TCPDataTransfer {
-EpollConsumerPool::EpollConsumerPool()
+namespace {
+const uint32_t REBALANCE_BUSY_HIGH = 700; // permille, consumers below it are left alone
+
+uint16_t consumerCountFor(const consumerPoolOptions& options, const cpuTopology& topology)
+{
+    unsigned count = options.consumerCount > 0 ? options.consumerCount : topology.usableCpus();
+    return static_cast<uint16_t>(std::clamp<unsigned>(count, 1, MAX_EPOLL_CONSUMERS));
+}
+
+// a saturated loop outweighs any connection count, queued bytes count per 64KB
+uint64_t loadScore(const consumerLoad& load)
+{
+    return load.connections + (load.queuedBytes >> 16) + static_cast<uint64_t>(load.busyPermille) * 8;
+}
+}
+
+EpollConsumerPool::EpollConsumerPool(const consumerPoolOptions& options) : connectionTable_(options.maxConnections)
 {
-    LOG_INFO("EpollConsumerPool init with MAX_EPOLL_CONSUMERS: " << MAX_EPOLL_CONSUMERS);
-    for (uint16_t i = 0; i < MAX_EPOLL_CONSUMERS; ++i) {
+    auto topology = cpuTopology::detect();
+    uint16_t count = consumerCountFor(options, topology);
+    LOG_INFO("EpollConsumerPool init with " << count << " consumers, usable cpus: " << topology.usableCpus());
+    auto nodes = topology.cpusByNode();
+    if (options.pinning != ConsumerPinning::NONE) {
+        consumersOfCpu_.resize(topology.nodeOfCpu.size());
+    }
+    epollConsumers_.resize(count);
+    for (uint16_t i = 0; i < count; ++i) {
+        std::vector<int> cpus;
+        if (options.pinning == ConsumerPinning::CORE) {
+            cpus.push_back(topology.cpus[i % topology.cpus.size()]);
+        } else if (options.pinning == ConsumerPinning::NUMA_NODE) {
+            cpus = nodes[i % nodes.size()];
+        }
+        for (int cpu : cpus) {
+            consumersOfCpu_[cpu].push_back(i);
+        }
         try {
-            epollConsumerMap_.insert({i, std::move(std::make_unique<EpollConsumer>(i))});
+            consumerOptions consumerOpts;
+            consumerOpts.backend = options.backend;
+            consumerOpts.cpus = std::move(cpus);
+            consumerOpts.budget = options.budget;
+            consumerOpts.connectionTable = &connectionTable_;
+            consumerOpts.connectTimeoutMs = options.connectTimeoutMs;
+            consumerOpts.idleTimeoutMs = options.idleTimeoutMs;
+            consumerOpts.heartbeatIntervalMs = options.heartbeatIntervalMs;
+            consumerOpts.coalesceDelayUs = options.coalesceDelayUs;
+            consumerOpts.coalesceSegmentBytes = options.coalesceSegmentBytes;
+            consumerOpts.coalesceFrameBytes = options.coalesceFrameBytes;
+            consumerOpts.controlBurstBytes = options.controlBurstBytes;
+            consumerOpts.busyPollUs = options.busyPollUs;
+            consumerOpts.socketBusyPollUs = options.socketBusyPollUs;
+            consumerOpts.bufferPool = options.bufferPool;
+            consumerOpts.socketBuffers = options.socketBuffers;
+            consumerOpts.compactConnections = options.compactConnections;
+            epollConsumers_[i] = std::make_unique<EpollConsumer>(i, std::move(consumerOpts));
+            epollConsumers_[i]->setConnectCallback([this](uint64_t connId, int socketFd, int error) {
+                onConnect(connId, socketFd, error);
+            });
+            epollConsumers_[i]->setDisconnectCallback([this](uint64_t connId, int socketFd, DisconnectReason reason) {
+                onDisconnect(connId, socketFd, reason);
+            });
+            if (options.pinning != ConsumerPinning::NONE) {
+                epollConsumers_[i]->setSteerCallback([this](int socketFd, uint64_t connId, int cpu) {
+                    steerConnection(socketFd, connId, cpu);
+                });
+            }
         } CATCH_AND_MSG("CONSUMERS INIT FAILED for index: " << i);
     }
+    if (options.rebalanceIntervalMs > 0) {
+        rebalanceThread_ = std::thread(&EpollConsumerPool::rebalanceLoop, this, std::chrono::milliseconds(options.rebalanceIntervalMs));
+    }
 }
 
 EpollConsumerPool::~EpollConsumerPool()
 {
-    for (auto& [id, consumer] : epollConsumerMap_) {
-        consumer->stop();
-    }
     {
-        std::unique_lock<std::shared_mutex> lock(socketUserEpollConsumerMap_mutex);
-        for (auto& [key, index] : socketUserEpollConsumerMap_) {
-            ::close(key.first);
+        std::lock_guard<std::mutex> lock(rebalanceMutex_);
+        rebalanceStopping_ = true;
+    }
+    rebalanceCv_.notify_all();
+    if (rebalanceThread_.joinable()) {
+        rebalanceThread_.join();
+    }
+    for (auto& consumer : epollConsumers_) {
+        if (consumer) {
+            consumer->stop();
         }
-        socketUserEpollConsumerMap_.clear();
     }
+    // consumers retire the slots of sockets they close, whatever is left is still open and owned by the table
+    connectionTable_.forEach([this](int socketFd, uint64_t connId) {
+        ::close(socketFd);
+        connectionTable_.retire(socketFd, connId);
+    });
 }
 
-bool EpollConsumerPool::addUserSocket(int socketFd, uint64_t userId)
+// the route stays pinned until unpin, so a migration cannot overtake the command about to be submitted
+EpollConsumer* EpollConsumerPool::pinRoute(int socketFd, uint64_t connId, uint16_t& index)
 {
-    int index = ++userIndex_ % MAX_EPOLL_CONSUMERS;
-    if (userIndex_ >= 1000000) {
-        userIndex_ = 0;
+    if (!connectionTable_.pin(socketFd, connId, index)) {
+        LOG_ERROR("cannot find socketFd: " << socketFd << " for connId: " << connId << " in connection table");
+        return nullptr;
     }
-    auto consumer = epollConsumerMap_.find(index);
-    if (consumer == epollConsumerMap_.end()) {
+    if (index >= epollConsumers_.size() || !epollConsumers_[index]) {
         LOG_ERROR("cannot find epoll consumer for index: " << index);
+        connectionTable_.unpin(socketFd);
+        return nullptr;
+    }
+    return epollConsumers_[index].get();
+}
+
+int EpollConsumerPool::leastLoadedConsumer(int cpu) const
+{
+    bool local = cpu >= 0 && static_cast<size_t>(cpu) < consumersOfCpu_.size() && !consumersOfCpu_[cpu].empty();
+    int best = -1;
+    uint64_t bestScore = 0;
+    for (size_t i = 0; i < epollConsumers_.size(); ++i) {
+        if (!epollConsumers_[i]) {
+            continue;
+        }
+        if (local && std::find(consumersOfCpu_[cpu].begin(), consumersOfCpu_[cpu].end(), i) == consumersOfCpu_[cpu].end()) {
+            continue;
+        }
+        uint64_t score = loadScore(epollConsumers_[i]->getLoad());
+        if (best < 0 || score < bestScore) {
+            best = static_cast<int>(i);
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+void EpollConsumerPool::steerConnection(int socketFd, uint64_t connId, int cpu)
+{
+    int index = leastLoadedConsumer(cpu);
+    uint16_t current = 0;
+    if (index < 0 || !connectionTable_.lookup(socketFd, connId, current) || current == index) {
+        return;
+    }
+    LOG_DEBUG("steering socketFd: " << socketFd << " for connId: " << connId << " to epoll consumer index: " << index
+        << " pinned near incoming cpu " << cpu);
+    migrateConnection(socketFd, connId, static_cast<uint16_t>(index));
+}
+
+void EpollConsumerPool::setConnectCallback(ConnectCallback callback)
+{
+    auto shared = callback ? std::make_shared<const ConnectCallback>(std::move(callback)) : nullptr;
+    std::atomic_store(&connectCallback_, std::move(shared));
+}
+
+void EpollConsumerPool::onConnect(uint64_t connId, int socketFd, int error)
+{
+    if (error != 0) {
+        connectionTable_.retire(socketFd, connId);
+    }
+    auto callback = std::atomic_load(&connectCallback_);
+    if (callback) {
+        (*callback)(connId, socketFd, error);
+    }
+}
+
+void EpollConsumerPool::setDisconnectCallback(DisconnectCallback callback)
+{
+    auto shared = callback ? std::make_shared<const DisconnectCallback>(std::move(callback)) : nullptr;
+    std::atomic_store(&disconnectCallback_, std::move(shared));
+}
+
+// retired before the consumer closes the socket, so the fd cannot be published again for a new connection meanwhile
+void EpollConsumerPool::onDisconnect(uint64_t connId, int socketFd, DisconnectReason reason)
+{
+    connectionTable_.retire(socketFd, connId);
+    auto callback = std::atomic_load(&disconnectCallback_);
+    if (callback) {
+        (*callback)(connId, socketFd, reason);
+    }
+}
+
+bool EpollConsumerPool::addUserSocket(int socketFd, uint64_t userId, bool connecting)
+{
+    // accepted sockets already know their receive CPU, connecting ones are steered after their first read
+    int cpu = -1;
+    if (!consumersOfCpu_.empty()) {
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(socketFd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) {
+            cpu = -1;
+        }
+    }
+    int index = leastLoadedConsumer(cpu);
+    if (index < 0) {
+        LOG_ERROR("no epoll consumer available for socketfd: " << socketFd << " for userId: " << userId);
         return false;
     }
-    if (consumer->second->addUserSocket(socketFd, userId)) {
+    auto& consumer = epollConsumers_[index];
+    // published first so sends issued right after the add already find their consumer
+    if (!connectionTable_.publish(socketFd, userId, static_cast<uint16_t>(index))) {
+        LOG_ERROR("failed to add user socketfd: " << socketFd << " for userId: " << userId << " to connection table");
+        return false;
+    }
+    if (consumer->addUserSocket(socketFd, userId, connecting)) {
         LOG_INFO("successfully add user socketfd: " << socketFd << " for userId: " << userId << " to epoll consumer index: " << index);
-        std::unique_lock<std::shared_mutex> lock(socketUserEpollConsumerMap_mutex);
-        socketUserEpollConsumerMap_.insert({std::make_pair(socketFd, userId), index});
         return true;
-    } 
+    }
+    connectionTable_.retire(socketFd, userId);
     LOG_ERROR("failed to add user socketfd: " << socketFd << " for userId: " << userId << " to epoll consumer index: " << index);
     return false;
 }
 
 void EpollConsumerPool::removeUserSocket(int socketFd, uint64_t userId)
 {
-    decltype(socketUserEpollConsumerMap_)::iterator it;
-    decltype(epollConsumerMap_)::iterator consumer;
-    int index = -1;
-    {
-        std::shared_lock<std::shared_mutex> lock(socketUserEpollConsumerMap_mutex);
-        it = socketUserEpollConsumerMap_.find({socketFd, userId});
-        if (it == socketUserEpollConsumerMap_.end()) {
-            LOG_ERROR("cannot find socketFd: " << socketFd << " for userId: " << userId << " in socketUserEpollConsumerMap_");
-            return;
-        }
-        index = it->second;
-    }
-    consumer = epollConsumerMap_.find(index);
-    if (consumer == epollConsumerMap_.end()) {
-        LOG_ERROR("cannot find epoll consumer for index: " << index);
+    uint16_t index = 0;
+    auto consumer = pinRoute(socketFd, userId, index);
+    if (!consumer) {
         return;
     }
-    if (consumer->second->removeUserSocket(socketFd, userId)) {
+    bool removed = consumer->removeUserSocket(socketFd, userId);
+    connectionTable_.unpin(socketFd);
+    if (removed) {
         LOG_INFO("successfully remove user socketfd: " << socketFd << " for userId: " << userId << " from epoll consumer index: " << index);
-        std::unique_lock<std::shared_mutex> lock(socketUserEpollConsumerMap_mutex);
-        socketUserEpollConsumerMap_.erase(it);
+        connectionTable_.retire(socketFd, userId);
         return;
-    } 
+    }
     LOG_ERROR("failed to remove user socketfd: " << socketFd << " for userId: " << userId << " from epoll consumer index: " << index);
 }
 
-bool EpollConsumerPool::sendData(int socketFd, uint64_t connId, const char* data, size_t len)
+// raw bytes are copied by the owning consumer, into its own buffer pool
+SendResult EpollConsumerPool::sendData(int socketFd, uint64_t connId, const char* data, size_t len, SendPriority priority)
 {
-    decltype(socketUserEpollConsumerMap_)::iterator it;
-    decltype(epollConsumerMap_)::iterator consumer;
-    int index = -1;
-    {
-        std::shared_lock<std::shared_mutex> lock(socketUserEpollConsumerMap_mutex);
-        it = socketUserEpollConsumerMap_.find({socketFd, connId});
-        if (it == socketUserEpollConsumerMap_.end()) {
-            LOG_ERROR("cannot find socketFd: " << socketFd << " for connId: " << connId << " in socketUserEpollConsumerMap_");
-            return false;
+    return routeSend(socketFd, connId, [&](EpollConsumer& consumer) {
+        return consumer.sendData(socketFd, connId, data, len, priority);
+    });
+}
+
+SendResult EpollConsumerPool::sendData(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority)
+{
+    return routeSend(socketFd, connId, [&](EpollConsumer& consumer) {
+        return consumer.sendData(socketFd, connId, std::move(data), priority);
+    });
+}
+
+SendResult EpollConsumerPool::sendData(int socketFd, uint64_t connId, const sendSpan* spans, size_t count, SendPriority priority)
+{
+    return routeSend(socketFd, connId, [&](EpollConsumer& consumer) {
+        return consumer.sendData(socketFd, connId, spans, count, priority);
+    });
+}
+
+SendResult EpollConsumerPool::sendFile(int socketFd, uint64_t connId, int fileFd, off_t offset, size_t len)
+{
+    return routeSend(socketFd, connId, [&](EpollConsumer& consumer) {
+        return consumer.sendFile(socketFd, connId, fileFd, offset, len);
+    });
+}
+
+template<typename Send>
+SendResult EpollConsumerPool::routeSend(int socketFd, uint64_t connId, Send&& send)
+{
+    uint16_t index = 0;
+    auto consumer = pinRoute(socketFd, connId, index);
+    if (!consumer) {
+        return SendResult::NOT_CONNECTED;
+    }
+    auto result = send(*consumer);
+    connectionTable_.unpin(socketFd);
+    if (result == SendResult::FAILED) {
+        LOG_ERROR("failed to send data to socketFd: " << socketFd << " for connId: " << connId << " from epoll consumer index: " << index);
+    }
+    return result;
+}
+
+void EpollConsumerPool::setRecvCallback(RecvCallback callback)
+{
+    for (auto& consumer : epollConsumers_) {
+        if (consumer) {
+            consumer->setRecvCallback(callback);
         }
-        index = it->second;
     }
-    consumer = epollConsumerMap_.find(index);
-    if (consumer == epollConsumerMap_.end()) {
-        LOG_ERROR("cannot find epoll consumer for index: " << index);
+}
+
+void EpollConsumerPool::setWritableCallback(WritableCallback callback)
+{
+    for (auto& consumer : epollConsumers_) {
+        if (consumer) {
+            consumer->setWritableCallback(callback);
+        }
+    }
+}
+
+bool EpollConsumerPool::setConnRecvCallback(int socketFd, uint64_t connId, RecvCallback callback)
+{
+    uint16_t index = 0;
+    auto consumer = pinRoute(socketFd, connId, index);
+    if (!consumer) {
         return false;
     }
-    if (consumer->second->sendData(socketFd, connId, data, len)) {
-        return true;
-    } 
-    LOG_ERROR("failed to send data to socketFd: " << socketFd << " for connId: " << connId << " from epoll consumer index: " << index);
-    return false;
+    bool queued = consumer->setConnRecvCallback(socketFd, connId, std::move(callback));
+    connectionTable_.unpin(socketFd);
+    return queued;
+}
+
+bool EpollConsumerPool::setConnCoalescing(int socketFd, uint64_t connId, bool enable)
+{
+    uint16_t index = 0;
+    auto consumer = pinRoute(socketFd, connId, index);
+    if (!consumer) {
+        return false;
+    }
+    bool queued = consumer->setConnCoalescing(socketFd, connId, enable);
+    connectionTable_.unpin(socketFd);
+    return queued;
+}
+
+void EpollConsumerPool::setZeroCopyThreshold(size_t bytes)
+{
+    for (auto& consumer : epollConsumers_) {
+        if (consumer) {
+            consumer->setZeroCopyThreshold(bytes);
+        }
+    }
+}
+
+sendStats EpollConsumerPool::getSendStats() const
+{
+    sendStats total;
+    for (const auto& consumer : epollConsumers_) {
+        if (consumer) {
+            total += consumer->getSendStats();
+        }
+    }
+    return total;
+}
+
+std::vector<consumerLoad> EpollConsumerPool::getConsumerLoads() const
+{
+    std::vector<consumerLoad> loads(epollConsumers_.size());
+    for (size_t i = 0; i < epollConsumers_.size(); ++i) {
+        if (epollConsumers_[i]) {
+            loads[i] = epollConsumers_[i]->getLoad();
+        }
+    }
+    return loads;
+}
+
+consumerMetrics EpollConsumerPool::getMetrics() const
+{
+    consumerMetrics total;
+    for (const auto& consumer : epollConsumers_) {
+        if (consumer) {
+            total += consumer->getMetrics();
+        }
+    }
+    return total;
+}
+
+std::vector<consumerMetrics> EpollConsumerPool::getConsumerMetrics() const
+{
+    std::vector<consumerMetrics> metrics(epollConsumers_.size());
+    for (size_t i = 0; i < epollConsumers_.size(); ++i) {
+        if (epollConsumers_[i]) {
+            metrics[i] = epollConsumers_[i]->getMetrics();
+        }
+    }
+    return metrics;
+}
+
+bufferPoolStats EpollConsumerPool::getBufferPoolStats() const
+{
+    bufferPoolStats total;
+    for (const auto& consumer : epollConsumers_) {
+        if (consumer) {
+            total += consumer->getBufferPoolStats();
+        }
+    }
+    return total;
+}
+
+bool EpollConsumerPool::migrateConnection(int socketFd, uint64_t connId, uint16_t targetConsumer)
+{
+    std::lock_guard<std::mutex> lock(migrateMutex_);
+    uint16_t source = 0;
+    if (!connectionTable_.lookup(socketFd, connId, source)) {
+        LOG_ERROR("cannot migrate socketFd: " << socketFd << " for connId: " << connId << ", not in connection table");
+        return false;
+    }
+    if (source == targetConsumer || targetConsumer >= epollConsumers_.size() || !epollConsumers_[targetConsumer] || !epollConsumers_[source]) {
+        LOG_ERROR("cannot migrate socketFd: " << socketFd << " for connId: " << connId << " from epoll consumer index: " << source
+            << " to index: " << targetConsumer);
+        return false;
+    }
+    auto& target = epollConsumers_[targetConsumer];
+    // the target must hold back commands from the moment the route switches until the state arrives
+    if (!target->expectConnection(socketFd, connId)) {
+        return false;
+    }
+    if (!connectionTable_.reroute(socketFd, connId, targetConsumer)) {
+        target->cancelExpectedConnection(socketFd, connId);
+        return false;
+    }
+    if (!epollConsumers_[source]->migrateConnection(socketFd, connId, target.get())) {
+        LOG_ERROR("failed to hand socketFd: " << socketFd << " for connId: " << connId << " to epoll consumer index: " << targetConsumer
+            << ", routing it back to index: " << source);
+        connectionTable_.reroute(socketFd, connId, source);
+        target->cancelExpectedConnection(socketFd, connId);
+        return false;
+    }
+    LOG_INFO("migrating socketFd: " << socketFd << " for connId: " << connId << " from epoll consumer index: " << source
+        << " to index: " << targetConsumer);
+    return true;
+}
+
+bool EpollConsumerPool::rebalance()
+{
+    auto loads = getConsumerLoads();
+    int source = -1;
+    int target = -1;
+    for (size_t i = 0; i < loads.size(); ++i) {
+        if (!epollConsumers_[i]) {
+            continue;
+        }
+        int index = static_cast<int>(i);
+        if (source < 0 || loads[i].busyPermille > loads[source].busyPermille) {
+            source = index;
+        }
+        if (target < 0 || loads[i].busyPermille < loads[target].busyPermille
+            || (loads[i].busyPermille == loads[target].busyPermille && loadScore(loads[i]) < loadScore(loads[target]))) {
+            target = index;
+        }
+    }
+    if (source < 0 || source == target) {
+        return false;
+    }
+    const auto& hot = loads[source];
+    if (hot.busyPermille < REBALANCE_BUSY_HIGH || hot.connections < 2 || hot.hotFd < 0 || hot.windowBytes == 0) {
+        return false;
+    }
+    // assume the loop time of the hot connection is proportional to its share of the bytes moved
+    uint64_t movedPermille = hot.busyPermille * std::min(hot.hotBytes, hot.windowBytes) / hot.windowBytes;
+    if (loads[target].busyPermille + movedPermille >= hot.busyPermille - movedPermille) {
+        return false; // moving it would only shift the hot spot
+    }
+    return migrateConnection(hot.hotFd, hot.hotConnId, static_cast<uint16_t>(target));
+}
+
+void EpollConsumerPool::rebalanceLoop(std::chrono::milliseconds interval)
+{
+    std::unique_lock<std::mutex> lock(rebalanceMutex_);
+    while (!rebalanceCv_.wait_for(lock, interval, [this] { return rebalanceStopping_; })) {
+        lock.unlock();
+        rebalance();
+        lock.lock();
+    }
 }
 }
\ No newline at end of file
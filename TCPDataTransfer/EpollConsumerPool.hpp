@@ -3,26 +3,110 @@
 #include <cstdint>
 #include <map>
 #include <memory>
+#include <vector>
 #include "EpollConsumer.hpp"
+#include "ConnectionTable.hpp"
+#include "CpuTopology.hpp"
 #include <atomic>
-#include <shared_mutex>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 namespace TCPDataTransfer {
+struct consumerPoolOptions {
+    ReactorBackend backend{ReactorBackend::EPOLL}; // IO_URING falls back to epoll on kernels without it
+    uint32_t rebalanceIntervalMs{1000}; // how often a hot connection may move off a saturated consumer, 0 disables
+    uint16_t consumerCount{0}; // 0 starts one consumer per usable CPU, capped at MAX_EPOLL_CONSUMERS
+    ConsumerPinning pinning{ConsumerPinning::NONE}; // pinned consumers also get sockets steered by SO_INCOMING_CPU
+    sendBudget budget;
+    uint32_t connectTimeoutMs{5000};
+    uint32_t idleTimeoutMs{0};       // see consumerOptions, 0 disables
+    uint32_t heartbeatIntervalMs{0}; // see consumerOptions, 0 disables
+    uint32_t coalesceDelayUs{200};   // see consumerOptions, applies to connections that opted in
+    size_t coalesceSegmentBytes{16 << 10};
+    size_t coalesceFrameBytes{512};
+    size_t controlBurstBytes{64 << 10}; // see consumerOptions
+    uint32_t busyPollUs{0};             // see consumerOptions, applies to every consumer
+    uint32_t socketBusyPollUs{0};
+    bufferPoolOptions bufferPool;       // see consumerOptions, every consumer gets a pool of its own
+    socketBufferOptions socketBuffers;  // see consumerOptions, adaptive sockets skip the fixed 1MB SO_SNDBUF
+    uint64_t maxConnections{MAX_CONNECTIONS}; // connections TCPDataTransfer admits, the connection table covers twice as many fds
+    bool compactConnections{false};           // see consumerOptions, for large numbers of mostly idle connections
+};
+
 class EpollConsumerPool {
 public:
-    EpollConsumerPool();
+    explicit EpollConsumerPool(const consumerPoolOptions& options = consumerPoolOptions());
     ~EpollConsumerPool();
-    bool addUserSocket(int socketFd, uint64_t userId);
+    bool addUserSocket(int socketFd, uint64_t userId, bool connecting = false);
     void removeUserSocket(int socketFd, uint64_t userId);
-    bool sendData(int socketFd, uint64_t connId, const char* data, size_t len);
+    SendResult sendData(int socketFd, uint64_t connId, const char* data, size_t len, SendPriority priority = SendPriority::BULK);
+    SendResult sendData(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority = SendPriority::BULK);
+    SendResult sendData(int socketFd, uint64_t connId, const sendSpan* spans, size_t count, SendPriority priority = SendPriority::BULK);
+    SendResult sendFile(int socketFd, uint64_t connId, int fileFd, off_t offset, size_t len);
+    void setRecvCallback(RecvCallback callback);
+    void setWritableCallback(WritableCallback callback);
+    /**
+     * Outcome of sockets added as connecting, failed ones are already dropped from routing and closed once it returns.
+     */
+    void setConnectCallback(ConnectCallback callback);
+    /**
+     * Connections the consumers closed on their own, already dropped from routing, sends to them return NOT_CONNECTED.
+     */
+    void setDisconnectCallback(DisconnectCallback callback);
+    bool setConnRecvCallback(int socketFd, uint64_t connId, RecvCallback callback);
+    bool setConnCoalescing(int socketFd, uint64_t connId, bool enable);
+    void setZeroCopyThreshold(size_t bytes);
+    sendStats getSendStats() const;
+    /**
+     * Live load of every consumer, indexed by consumer tag, failed consumers read as empty.
+     */
+    std::vector<consumerLoad> getConsumerLoads() const;
+    /**
+     * Counters summed over all consumers, histograms included. Reading them never stops a consumer.
+     */
+    consumerMetrics getMetrics() const;
+    /**
+     * Same counters per consumer, indexed by consumer tag, failed consumers read as empty.
+     */
+    std::vector<consumerMetrics> getConsumerMetrics() const;
+    /**
+     * Buffer pool occupancy summed over all consumers.
+     */
+    bufferPoolStats getBufferPoolStats() const;
+    /**
+     * Moves a connection into another consumer's reactor together with its queued data, the send order is kept.
+     */
+    bool migrateConnection(int socketFd, uint64_t connId, uint16_t targetConsumer);
+    /**
+     * Moves the hottest connection of the busiest consumer to the least loaded one when that narrows the gap.
+     * Runs every rebalanceIntervalMs on its own thread, callable directly as well.
+     */
+    bool rebalance();
 private:
     bool start();
     bool stop();
+    EpollConsumer* pinRoute(int socketFd, uint64_t connId, uint16_t& index);
+    template<typename Send>
+    SendResult routeSend(int socketFd, uint64_t connId, Send&& send);
+    /**
+     * @param cpu prefer the consumers pinned to this CPU, -1 or an unpinned CPU considers all of them.
+     */
+    int leastLoadedConsumer(int cpu = -1) const;
+    void steerConnection(int socketFd, uint64_t connId, int cpu);
+    void onConnect(uint64_t connId, int socketFd, int error);
+    void onDisconnect(uint64_t connId, int socketFd, DisconnectReason reason);
+    void rebalanceLoop(std::chrono::milliseconds interval);
 private:
-    std::map<uint16_t, std::unique_ptr<EpollConsumer>> epollConsumerMap_;
-    std::map<uint16_t, uint64_t> epollConsumerConnectNumMap_;
-    std::atomic<uint32_t> userIndex_;
-    std::map<std::pair<int, uint64_t>, uint16_t> socketUserEpollConsumerMap_;
-    std::shared_mutex socketUserEpollConsumerMap_mutex;
+    std::vector<std::unique_ptr<EpollConsumer>> epollConsumers_; // indexed by consumer tag, null if it failed to start
+    ConnectionTable connectionTable_;
+    std::vector<std::vector<uint16_t>> consumersOfCpu_; // indexed by cpu id, empty unless consumers are pinned
+    std::shared_ptr<const ConnectCallback> connectCallback_; // accessed through std::atomic_load/atomic_store
+    std::shared_ptr<const DisconnectCallback> disconnectCallback_; // same
+    std::mutex migrateMutex_; // one migration at a time
+    std::mutex rebalanceMutex_;
+    std::condition_variable rebalanceCv_;
+    bool rebalanceStopping_{false};
+    std::thread rebalanceThread_;
 };
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "EpollReactor.hpp"
+#include <unistd.h>
+#include <cerrno>
+#include <ctime>
+
+namespace TCPDataTransfer {
+EpollReactor::EpollReactor() : epollFd_(-1)
+{
+}
+
+EpollReactor::~EpollReactor()
+{
+    if (epollFd_ != -1) {
+        ::close(epollFd_);
+        epollFd_ = -1;
+    }
+}
+
+bool EpollReactor::init()
+{
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    return epollFd_ != -1;
+}
+
+bool EpollReactor::add(int socketFd, uint32_t events)
+{
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = socketFd;
+    return epoll_ctl(epollFd_, EPOLL_CTL_ADD, socketFd, &event) == 0;
+}
+
+bool EpollReactor::remove(int socketFd)
+{
+    return epoll_ctl(epollFd_, EPOLL_CTL_DEL, socketFd, nullptr) == 0;
+}
+
+int EpollReactor::wait(epoll_event* events, int maxEvents, int64_t timeoutUs)
+{
+    if (timeoutUs > 0 && finerWait_) {
+        timespec timeout{static_cast<time_t>(timeoutUs / 1000000), static_cast<long>(timeoutUs % 1000000) * 1000L};
+        int count = epoll_pwait2(epollFd_, events, maxEvents, &timeout, nullptr);
+        if (count >= 0 || errno != ENOSYS) {
+            return count;
+        }
+        finerWait_ = false;
+    }
+    int timeoutMs = timeoutUs <= 0 ? static_cast<int>(timeoutUs) : static_cast<int>((timeoutUs + 999) / 1000);
+    return epoll_wait(epollFd_, events, maxEvents, timeoutMs);
+}
+}
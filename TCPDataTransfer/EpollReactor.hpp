@@ -0,0 +1,20 @@
+#pragma once
+
+#include "Reactor.hpp"
+
+namespace TCPDataTransfer {
+class EpollReactor : public Reactor {
+public:
+    EpollReactor();
+    ~EpollReactor() override;
+
+    bool init();
+    bool add(int socketFd, uint32_t events) override;
+    bool remove(int socketFd) override;
+    int wait(epoll_event* events, int maxEvents, int64_t timeoutUs) override;
+    const char* name() const override { return "epoll"; }
+private:
+    int epollFd_;
+    bool finerWait_{true}; // epoll_pwait2, kernels before 5.11 round the timeout up to milliseconds
+};
+}
@@ -0,0 +1,293 @@
+#include "IoUringReactor.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace TCPDataTransfer {
+namespace {
+const uint64_t REMOVE_USER_DATA = ~0ULL; // completions of our own POLL_REMOVE requests, ignored
+
+unsigned loadAcquire(const unsigned* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void storeRelease(unsigned* p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+}
+
+IoUringReactor::IoUringReactor(unsigned entries) : ringFd_(-1), entries_(entries)
+{
+}
+
+IoUringReactor::~IoUringReactor()
+{
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqesSize_);
+    }
+    if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    if (sqRing_ != nullptr) {
+        munmap(sqRing_, sqRingSize_);
+    }
+    if (ringFd_ != -1) {
+        ::close(ringFd_);
+    }
+}
+
+bool IoUringReactor::init()
+{
+    io_uring_params params{};
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries_, &params));
+    if (ringFd_ < 0 && errno == EINVAL) {
+        params = io_uring_params{};
+        ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries_, &params));
+    }
+    if (ringFd_ < 0) {
+        return false;
+    }
+    // EXT_ARG gives wait timeouts without a timeout SQE, RSRC_TAGS marks 5.13 which brought multishot poll
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_RSRC_TAGS)) {
+        errno = ENOTSUP;
+        return false;
+    }
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            return false;
+        }
+    }
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    auto* sq = static_cast<char*>(sqRing_);
+    auto* cq = static_cast<char*>(cqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    entries_ = params.sq_entries;
+    return true;
+}
+
+uint64_t IoUringReactor::pollUserData(int socketFd, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(socketFd);
+}
+
+IoUringReactor::pollState& IoUringReactor::stateOf(int socketFd)
+{
+    if (static_cast<size_t>(socketFd) >= pollStates_.size()) {
+        pollStates_.resize(static_cast<size_t>(socketFd) + 1);
+    }
+    return pollStates_[socketFd];
+}
+
+unsigned IoUringReactor::pendingSqes() const
+{
+    return *sqTail_ - loadAcquire(sqHead_);
+}
+
+io_uring_sqe* IoUringReactor::nextSqe()
+{
+    while (pendingSqes() >= entries_) {
+        // ring full, hand what we have to the kernel before queueing more
+        if (enter(pendingSqes(), 0, 0, nullptr) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return nullptr;
+        }
+    }
+    unsigned tail = *sqTail_;
+    unsigned index = tail & sqMask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray_[index] = index;
+    return sqe;
+}
+
+void IoUringReactor::queuePollAdd(int socketFd, const pollState& state)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (sqe == nullptr) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = socketFd;
+    sqe->poll32_events = state.events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = pollUserData(socketFd, state.generation);
+    storeRelease(sqTail_, *sqTail_ + 1);
+}
+
+void IoUringReactor::queuePollRemove(int socketFd, const pollState& state)
+{
+    io_uring_sqe* sqe = nextSqe();
+    if (sqe == nullptr) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = pollUserData(socketFd, state.generation);
+    sqe->user_data = REMOVE_USER_DATA;
+    storeRelease(sqTail_, *sqTail_ + 1);
+}
+
+int IoUringReactor::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, const timespec* timeout)
+{
+    if (timeout == nullptr) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, nullptr, 0));
+    }
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_nsec;
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    return static_cast<int>(syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete,
+        flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+}
+
+// calls made on the waiting thread are batched into its next wait(), anyone else submits right away
+void IoUringReactor::submitIfForeign()
+{
+    if (std::this_thread::get_id() == ownerThread_) {
+        return;
+    }
+    unsigned pending = pendingSqes();
+    if (pending > 0) {
+        enter(pending, 0, 0, nullptr);
+    }
+}
+
+bool IoUringReactor::add(int socketFd, uint32_t events)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pollState& state = stateOf(socketFd);
+    if (state.active) {
+        errno = EEXIST;
+        return false;
+    }
+    state.generation++;
+    state.events = events;
+    state.active = true;
+    queuePollAdd(socketFd, state);
+    submitIfForeign();
+    return true;
+}
+
+bool IoUringReactor::remove(int socketFd)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    pollState& state = stateOf(socketFd);
+    if (!state.active) {
+        errno = ENOENT;
+        return false;
+    }
+    queuePollRemove(socketFd, state);
+    state.generation++;
+    state.active = false;
+    submitIfForeign();
+    return true;
+}
+
+int IoUringReactor::harvest(epoll_event* events, int maxEvents)
+{
+    int count = 0;
+    unsigned head = *cqHead_;
+    unsigned tail = loadAcquire(cqTail_);
+    while (head != tail && count < maxEvents) {
+        const io_uring_cqe& cqe = cqes_[head & cqMask_];
+        ++head;
+        if (cqe.user_data == REMOVE_USER_DATA) {
+            continue;
+        }
+        int socketFd = static_cast<int>(cqe.user_data & 0xffffffffu);
+        uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 32);
+        if (static_cast<size_t>(socketFd) >= pollStates_.size()) {
+            continue;
+        }
+        pollState& state = pollStates_[socketFd];
+        if (!state.active || state.generation != generation) {
+            continue; // completion of a request cancelled by remove()
+        }
+        bool terminated = !(cqe.flags & IORING_CQE_F_MORE);
+        if (cqe.res == -ECANCELED) {
+            if (terminated) {
+                queuePollAdd(socketFd, state);
+            }
+            continue;
+        }
+        if (terminated) {
+            // the kernel ends multishot polls e.g. on CQ overflow, arm again with the same interest
+            queuePollAdd(socketFd, state);
+        }
+        events[count].events = cqe.res < 0 ? (EPOLLERR | EPOLLHUP) : static_cast<uint32_t>(cqe.res);
+        events[count].data.fd = socketFd;
+        ++count;
+    }
+    storeRelease(cqHead_, head);
+    return count;
+}
+
+int IoUringReactor::wait(epoll_event* events, int maxEvents, int64_t timeoutUs)
+{
+    while (true) {
+        unsigned pending = 0;
+        bool ready = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ownerThread_ = std::this_thread::get_id();
+            pending = pendingSqes();
+            ready = *cqHead_ != loadAcquire(cqTail_);
+        }
+        int ret = 0;
+        if (ready || timeoutUs == 0) {
+            ret = pending > 0 ? enter(pending, 0, 0, nullptr) : 0;
+        } else if (timeoutUs < 0) {
+            ret = enter(pending, 1, IORING_ENTER_GETEVENTS, nullptr);
+        } else {
+            timespec timeout{static_cast<time_t>(timeoutUs / 1000000), static_cast<long>(timeoutUs % 1000000) * 1000L};
+            ret = enter(pending, 1, IORING_ENTER_GETEVENTS, &timeout);
+        }
+        if (ret < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+            return -1;
+        }
+        int count = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            count = harvest(events, maxEvents);
+        }
+        // only cancellations or stale completions arrived, keep blocking for real events
+        if (count > 0 || timeoutUs >= 0) {
+            return count;
+        }
+    }
+}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Reactor.hpp"
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <ctime>
+#include <linux/io_uring.h>
+
+namespace TCPDataTransfer {
+/**
+ * io_uring backend driven through raw syscalls, no liburing dependency.
+ * Interest is expressed as multishot IORING_OP_POLL_ADD requests, so add/remove only queue
+ * SQEs and the next wait() submits all of them together with the wait in one io_uring_enter.
+ * Readiness only: the ring replaces epoll_wait, reads and writes stay on the consumer's recv and sendmsg
+ * path, there are no SEND/RECV requests or registered buffers.
+ * Sockets are passed as plain fds, a fixed file table would only save the fget of a multishot poll armed once.
+ * Requires 5.13+ (multishot poll, IORING_ENTER_EXT_ARG), init() fails on older kernels.
+ */
+class IoUringReactor : public Reactor {
+public:
+    explicit IoUringReactor(unsigned entries = 4096);
+    ~IoUringReactor() override;
+
+    bool init();
+    bool add(int socketFd, uint32_t events) override;
+    bool remove(int socketFd) override;
+    int wait(epoll_event* events, int maxEvents, int64_t timeoutUs) override;
+    const char* name() const override { return "io_uring"; }
+private:
+    struct pollState {
+        uint32_t generation{0};
+        uint32_t events{0};
+        bool active{false};
+    };
+
+    io_uring_sqe* nextSqe();
+    void queuePollAdd(int socketFd, const pollState& state);
+    void queuePollRemove(int socketFd, const pollState& state);
+    unsigned pendingSqes() const;
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, const timespec* timeout);
+    void submitIfForeign();
+    int harvest(epoll_event* events, int maxEvents);
+    pollState& stateOf(int socketFd);
+    static uint64_t pollUserData(int socketFd, uint32_t generation);
+private:
+    int ringFd_;
+    unsigned entries_;
+    void* sqRing_{nullptr};
+    size_t sqRingSize_{0};
+    void* cqRing_{nullptr};
+    size_t cqRingSize_{0};
+    io_uring_sqe* sqes_{nullptr};
+    size_t sqesSize_{0};
+    unsigned* sqHead_{nullptr};
+    unsigned* sqTail_{nullptr};
+    unsigned* sqArray_{nullptr};
+    unsigned sqMask_{0};
+    unsigned* cqHead_{nullptr};
+    unsigned* cqTail_{nullptr};
+    io_uring_cqe* cqes_{nullptr};
+    unsigned cqMask_{0};
+    std::vector<pollState> pollStates_;
+    std::thread::id ownerThread_;
+    std::mutex mutex_; // sockets may still be added from other threads than the one calling wait()
+};
+}
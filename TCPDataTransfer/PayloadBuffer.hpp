@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace TCPDataTransfer {
+/**
+ * Caller owned bytes making up one part of an outbound message, e.g. a header and a body built separately.
+ */
+struct sendSpan {
+    const char* data;
+    size_t len;
+};
+
+/**
+ * Immutable, reference counted view over outbound bytes. Copies only bump the owner's refcount,
+ * so one payload can be queued on many sockets and released after the last socket has sent it.
+ * The viewed bytes must never be modified while any PayloadBuffer refers to them.
+ */
+class PayloadBuffer {
+public:
+    PayloadBuffer() = default;
+    PayloadBuffer(std::shared_ptr<const void> owner, const char* data, size_t len)
+        : owner_(std::move(owner)), data_(data), len_(len) {}
+
+    /**
+     * Copies data once into a new buffer, binary safe.
+     */
+    static PayloadBuffer copyOf(const char* data, size_t len)
+    {
+        auto owner = std::make_shared<std::string>(data, len);
+        const char* bytes = owner->data();
+        return PayloadBuffer(std::move(owner), bytes, len);
+    }
+
+    /**
+     * Gathers the spans into one new buffer, in order, without concatenating them first.
+     */
+    static PayloadBuffer copyOf(const sendSpan* spans, size_t count)
+    {
+        auto owner = std::make_shared<std::string>();
+        owner->reserve(totalSize(spans, count));
+        for (size_t i = 0; i < count; ++i) {
+            owner->append(spans[i].data, spans[i].len);
+        }
+        const char* bytes = owner->data();
+        size_t len = owner->size();
+        return PayloadBuffer(std::move(owner), bytes, len);
+    }
+
+    static size_t totalSize(const sendSpan* spans, size_t count)
+    {
+        size_t len = 0;
+        for (size_t i = 0; i < count; ++i) {
+            len += spans[i].len;
+        }
+        return len;
+    }
+
+    /**
+     * Takes over a string without copying its bytes.
+     */
+    static PayloadBuffer fromString(std::string&& str)
+    {
+        auto owner = std::make_shared<const std::string>(std::move(str));
+        const char* bytes = owner->data();
+        size_t len = owner->size();
+        return PayloadBuffer(std::move(owner), bytes, len);
+    }
+
+    /**
+     * Sub range sharing the same owner, offset and len are clamped to this buffer.
+     */
+    PayloadBuffer slice(size_t offset, size_t len) const
+    {
+        offset = std::min(offset, len_);
+        len = std::min(len, len_ - offset);
+        return PayloadBuffer(owner_, data_ + offset, len);
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return len_; }
+    bool empty() const { return len_ == 0; }
+private:
+    std::shared_ptr<const void> owner_;
+    const char* data_{nullptr};
+    size_t len_{0};
+};
+}
@@ -0,0 +1,33 @@
+#include "Reactor.hpp"
+#include "EpollReactor.hpp"
+#include "LogMacro.hpp"
+#include <cstring>
+#if __has_include(<linux/io_uring.h>)
+#include "IoUringReactor.hpp"
+#define TCP_DATA_TRANSFER_HAS_IO_URING 1
+#endif
+
+namespace TCPDataTransfer {
+std::unique_ptr<Reactor> Reactor::create(ReactorBackend backend, int consumerTag)
+{
+#ifdef TCP_DATA_TRANSFER_HAS_IO_URING
+    if (backend == ReactorBackend::IO_URING) {
+        auto reactor = std::make_unique<IoUringReactor>();
+        if (reactor->init()) {
+            return reactor;
+        }
+        LOG_WARNING("EpollConsumer" << consumerTag << ", io_uring unavailable: " << strerror(errno) << ", falling back to epoll");
+    }
+#else
+    if (backend == ReactorBackend::IO_URING) {
+        LOG_WARNING("EpollConsumer" << consumerTag << ", built without io_uring headers, falling back to epoll");
+    }
+#endif
+    auto reactor = std::make_unique<EpollReactor>();
+    if (!reactor->init()) {
+        LOG_ERROR("EpollConsumer" << consumerTag << ", failed to create epoll instance: " << strerror(errno));
+        return nullptr;
+    }
+    return reactor;
+}
+}
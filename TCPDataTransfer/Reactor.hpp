@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <sys/epoll.h>
+
+namespace TCPDataTransfer {
+enum class ReactorBackend { EPOLL, IO_URING };
+
+/**
+ * Readiness notification backend of one EpollConsumer. Interest masks and reported events use the
+ * EPOLL* bits for every backend, reported events carry the socket fd in data.fd. Interest is fixed for a
+ * socket's lifetime, the consumer keeps EPOLLOUT on and only acts on it while a flush is blocked.
+ */
+class Reactor {
+public:
+    virtual ~Reactor() = default;
+
+    virtual bool add(int socketFd, uint32_t events) = 0;
+    virtual bool remove(int socketFd) = 0;
+    /**
+     * Blocks for at most timeoutUs microseconds (-1 forever, 0 poll) until at least one event is ready.
+     * @return number of events written, 0 on timeout, -1 with errno set on failure.
+     */
+    virtual int wait(epoll_event* events, int maxEvents, int64_t timeoutUs) = 0;
+    virtual const char* name() const = 0;
+
+    /**
+     * Creates the requested backend, falls back to epoll when io_uring is unavailable on this kernel.
+     * @return nullptr if no backend could be created.
+     */
+    static std::unique_ptr<Reactor> create(ReactorBackend backend, int consumerTag);
+};
+}
@@ -0,0 +1,90 @@
+#include "RecvBuffer.hpp"
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <arpa/inet.h>
+
+namespace TCPDataTransfer {
+RecvBuffer::RecvBuffer(size_t capacity, BufferPool* pool) : pool_(pool), capacity_(capacity)
+{
+}
+
+RecvBuffer::~RecvBuffer()
+{
+    replaceStorage(0, false);
+}
+
+/**
+ * Swaps the storage for one of bytes, 0 only frees it. The buffered bytes move to the front of the new
+ * storage when keepBuffered is set. On failure the old storage is kept.
+ */
+bool RecvBuffer::replaceStorage(size_t bytes, bool keepBuffered)
+{
+    char* storage = nullptr;
+    bool pooled = false;
+    if (bytes > 0) {
+        if (pool_) {
+            storage = static_cast<char*>(pool_->tryAllocate(bytes));
+            pooled = storage != nullptr;
+        }
+        if (!storage) {
+            storage = new (std::nothrow) char[bytes];
+            if (!storage) {
+                return false;
+            }
+        }
+        if (keepBuffered) {
+            std::memcpy(storage, data_ + head_, buffered());
+        }
+    }
+    if (data_) {
+        if (pooled_) {
+            pool_->release(data_, allocated_);
+        } else {
+            delete[] data_;
+        }
+    }
+    tail_ = keepBuffered ? buffered() : 0;
+    head_ = 0;
+    data_ = storage;
+    pooled_ = pooled;
+    allocated_ = bytes;
+    return true;
+}
+
+bool RecvBuffer::prepareWrite()
+{
+    if (!data_) {
+        return replaceStorage(capacity_, false);
+    }
+    if (buffered() == 0 && allocated_ > capacity_) {
+        // drop the storage grown for an oversized frame once it has been consumed
+        return replaceStorage(capacity_, false);
+    }
+    if (writable() > 0) {
+        return true;
+    }
+    size_t needed = allocated_;
+    if (buffered() >= FRAME_HEADER_SIZE) {
+        uint32_t frameLen = peekFrameLen();
+        if (frameLen <= MAX_FRAME_SIZE) {
+            needed = std::max(needed, static_cast<size_t>(FRAME_HEADER_SIZE) + frameLen);
+        }
+    }
+    if (head_ > 0 && needed <= allocated_) {
+        std::memmove(data_, data_ + head_, buffered());
+        tail_ -= head_;
+        head_ = 0;
+        return true;
+    }
+    // a single frame is bigger than the buffer, grow to hold it whole so it can be handed out in place
+    return replaceStorage(std::max(needed, allocated_ * 2), true);
+}
+
+uint32_t RecvBuffer::peekFrameLen() const
+{
+    uint32_t netLen = 0;
+    std::memcpy(&netLen, data_ + head_, sizeof(netLen));
+    return ntohl(netLen);
+}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include "ConnectionDef.hpp"
+#include "BufferPool.hpp"
+
+namespace TCPDataTransfer {
+/**
+ * Called once per decoded frame. data points into the connection's receive buffer and is only valid
+ * until the callback returns, copy it if it must outlive the call.
+ */
+using RecvCallback = std::function<void(uint64_t connId, const char* data, size_t len)>;
+
+/**
+ * Per-connection receive buffer. Bytes are read straight into the free tail, complete frames
+ * (FRAME_HEADER_SIZE bytes big-endian payload length + payload) are handed out in place, and only
+ * the trailing partial frame is moved back to the front before the next read.
+ * Storage is allocated on first use so idle connections cost nothing, from the pool when one is given and
+ * it has room, from the global allocator otherwise.
+ */
+class RecvBuffer {
+public:
+    explicit RecvBuffer(size_t capacity = RECV_BUFFER_SIZE, BufferPool* pool = nullptr);
+    ~RecvBuffer();
+    RecvBuffer(const RecvBuffer&) = delete;
+    RecvBuffer& operator=(const RecvBuffer&) = delete;
+
+    /**
+     * Makes sure there is free space behind the buffered bytes, compacting or growing as needed.
+     * @return false if the storage could not be allocated.
+     */
+    bool prepareWrite();
+    char* writePtr() { return data_ + tail_; }
+    size_t writable() const { return allocated_ - tail_; }
+    void commit(size_t len) { tail_ += len; }
+    size_t buffered() const { return tail_ - head_; }
+    /**
+     * Frees the storage unless a partial frame is still buffered, the next prepareWrite() allocates it again.
+     */
+    void release()
+    {
+        if (data_ && buffered() == 0) {
+            replaceStorage(0, false);
+        }
+    }
+
+    /**
+     * Hands every complete buffered frame to onFrame(const char* payload, size_t len).
+     * @return false if a frame header announces a payload larger than MAX_FRAME_SIZE.
+     */
+    template<typename OnFrame>
+    bool decodeFrames(OnFrame&& onFrame)
+    {
+        while (buffered() >= FRAME_HEADER_SIZE) {
+            uint32_t frameLen = peekFrameLen();
+            if (frameLen > MAX_FRAME_SIZE) {
+                return false;
+            }
+            if (buffered() - FRAME_HEADER_SIZE < frameLen) {
+                break;
+            }
+            const char* payload = data_ + head_ + FRAME_HEADER_SIZE;
+            head_ += FRAME_HEADER_SIZE + frameLen;
+            onFrame(payload, static_cast<size_t>(frameLen));
+        }
+        if (head_ == tail_) {
+            head_ = tail_ = 0;
+        }
+        return true;
+    }
+private:
+    uint32_t peekFrameLen() const;
+    bool replaceStorage(size_t bytes, bool keepBuffered);
+private:
+    BufferPool* pool_;
+    char* data_{nullptr};
+    bool pooled_{false}; // data_ is a pool block of allocated_ bytes
+    size_t capacity_;
+    size_t allocated_{0};
+    size_t head_{0};
+    size_t tail_{0};
+};
+}
@@ -0,0 +1,337 @@
+#include "SendQueue.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+namespace TCPDataTransfer {
+namespace {
+// page cache misses are read on the consumer thread, a chunk bounds how long one call can stall it
+const size_t FILE_CHUNK_BYTES = 256 << 10;
+}
+
+void SendQueue::laneDeleter::operator()(laneStorage* lanes) const
+{
+    lanes->~laneStorage();
+    PoolAllocator<laneStorage>(pool).deallocate(lanes, 1);
+}
+
+SendQueue::laneStorage& SendQueue::lanes()
+{
+    if (!lanes_) {
+        PoolAllocator<laneStorage> allocator(lanes_.get_deleter().pool);
+        laneStorage* lanes = allocator.allocate(1);
+        try {
+            new (lanes) laneStorage(allocator.pool());
+        } catch (...) {
+            allocator.deallocate(lanes, 1);
+            throw;
+        }
+        lanes_.reset(lanes);
+    }
+    return *lanes_;
+}
+
+void SendQueue::release()
+{
+    if (empty() && !hasZeroCopyInflight()) {
+        lanes_.reset();
+        segment_.reset();
+        partial_ = Lane::NONE;
+        overtaken_ = 0;
+    }
+}
+
+void SendQueue::push(PayloadBuffer data, SendPriority priority)
+{
+    auto& storage = lanes();
+    queuedBytes_ += data.size();
+    if (priority == SendPriority::CONTROL) {
+        storage.control.emplace_back(std::move(data));
+        return;
+    }
+    storage.bulk.emplace_back(std::move(data));
+}
+
+// the buffer the next send starts with, a non empty queue always has one
+pendingData& SendQueue::head(const flushContext& context)
+{
+    auto& control = lanes_->control;
+    auto& bulk = lanes_->bulk;
+    Lane lane = partial_ != Lane::NONE ? partial_ : pickLane(!control.empty(), !bulk.empty(), overtaken_, context.controlBurstBytes);
+    return lane == Lane::CONTROL ? control.front() : bulk.front();
+}
+
+void SendQueue::pushCoalesced(PayloadBuffer data, size_t segmentBytes)
+{
+    if (data.size() > segmentBytes) {
+        push(std::move(data));
+        return;
+    }
+    auto& bulk = lanes().bulk;
+    queuedBytes_ += data.size();
+    // appending within the reserved capacity never moves bytes a partial write or zero copy send still points at
+    bool open = segment_ && !bulk.empty() && bulk.back().data.data() == segment_->data()
+        && segment_->size() + data.size() <= segment_->capacity();
+    if (!open) {
+        if (!segment_ || segment_.use_count() > 1) {
+            segment_ = std::make_shared<std::string>(); // the last one is still queued or held by a zero copy send
+        }
+        segment_->clear();
+        segment_->reserve(segmentBytes);
+        bulk.emplace_back(PayloadBuffer());
+    }
+    segment_->append(data.data(), data.size());
+    bulk.back().data = PayloadBuffer(segment_, segment_->data(), segment_->size());
+}
+
+void SendQueue::pushFile(std::unique_ptr<fileRange> file)
+{
+    lanes().bulk.emplace_back(std::move(file));
+}
+
+bool SendQueue::useZeroCopy(int socketFd, const flushContext& context)
+{
+    size_t threshold = context.zeroCopyThreshold.load(std::memory_order_relaxed);
+    if (threshold == 0 || zeroCopyUnsupported_) {
+        return false;
+    }
+    const auto& front = head(context);
+    if (front.size() - front.index < threshold) {
+        return false;
+    }
+    if (!zeroCopyEnabled_) {
+        int opt = 1;
+        if (setsockopt(socketFd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) < 0) {
+            // old kernel or non TCP socket, stay on the copy path for good
+            zeroCopyUnsupported_ = true;
+            return false;
+        }
+        zeroCopyEnabled_ = true;
+    }
+    return true;
+}
+
+ssize_t SendQueue::sendZeroCopy(int socketFd, flushContext& context)
+{
+    auto& front = head(context);
+    struct iovec iov{};
+    iov.iov_base = const_cast<char*>(front.data.data()) + front.index;
+    iov.iov_len = front.data.size() - front.index;
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    ssize_t sent = ::sendmsg(socketFd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | MSG_ZEROCOPY);
+    if (sent > 0) {
+        // the kernel numbers every successful MSG_ZEROCOPY call, keep the bytes alive until that number completes
+        lanes_->inflight.push_back({zeroCopySeq_++, false, front.data});
+        context.counters.zeroCopySends.fetch_add(1, std::memory_order_relaxed);
+        context.counters.zeroCopyBytes.fetch_add(static_cast<uint64_t>(sent), std::memory_order_relaxed);
+    }
+    return sent;
+}
+
+ssize_t SendQueue::sendFileChunk(int socketFd, size_t chunk, flushContext& context)
+{
+    auto& front = head(context);
+    off_t offset = front.file->offset + static_cast<off_t>(front.index);
+    ssize_t sent = ::sendfile(socketFd, front.file->fd, &offset, chunk);
+    if (sent == 0) {
+        errno = ENODATA; // the file was truncated below the queued range, the rest of the stream would be misframed
+        return -1;
+    }
+    if (sent > 0) {
+        context.counters.fileBytes.fetch_add(static_cast<uint64_t>(sent), std::memory_order_relaxed);
+    }
+    return sent;
+}
+
+SendQueue::FlushResult SendQueue::flush(int socketFd, flushContext& context, size_t& bytesSent)
+{
+    bytesSent = 0;
+    bool zeroCopyRefused = false;
+    while (!empty()) {
+        if (head(context).file) {
+            size_t wanted = std::min(head(context).size() - head(context).index, FILE_CHUNK_BYTES);
+            ssize_t sent = sendFileChunk(socketFd, wanted, context);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? FlushResult::AGAIN : FlushResult::ERROR;
+            }
+            consume(static_cast<size_t>(sent), context);
+            bytesSent += static_cast<size_t>(sent);
+            if (static_cast<size_t>(sent) < wanted) {
+                return FlushResult::AGAIN;
+            }
+            continue;
+        }
+        if (!zeroCopyRefused && useZeroCopy(socketFd, context)) {
+            size_t wanted = head(context).size() - head(context).index;
+            ssize_t sent = sendZeroCopy(socketFd, context);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return FlushResult::AGAIN;
+                }
+                if (errno != ENOBUFS) {
+                    return FlushResult::ERROR;
+                }
+                // out of optmem for pinned pages, copy this pass instead of stalling
+                context.counters.zeroCopyFallbacks.fetch_add(1, std::memory_order_relaxed);
+                zeroCopyRefused = true;
+                continue;
+            }
+            consume(static_cast<size_t>(sent), context);
+            bytesSent += static_cast<size_t>(sent);
+            if (static_cast<size_t>(sent) < wanted) {
+                return FlushResult::AGAIN;
+            }
+            continue;
+        }
+        size_t zeroCopyThreshold = (zeroCopyUnsupported_ || zeroCopyRefused) ? 0 :
+            context.zeroCopyThreshold.load(std::memory_order_relaxed);
+        size_t iovCount = 0;
+        size_t batchBytes = 0;
+        size_t maxIov = std::min(size(), static_cast<size_t>(IOV_MAX));
+        context.iovecs.resize(maxIov);
+        // plans the lane order on copies of the cursor state, consume() walks the same order on the real one
+        size_t controlNext = 0;
+        size_t bulkNext = 0;
+        Lane partial = partial_;
+        size_t overtaken = overtaken_;
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        auto& control = lanes_->control;
+        auto& bulk = lanes_->bulk;
+        for (; iovCount < maxIov; ++iovCount) {
+            Lane lane = partial != Lane::NONE ? partial :
+                pickLane(controlNext < control.size(), bulkNext < bulk.size(), overtaken, context.controlBurstBytes);
+            auto& item = lane == Lane::CONTROL ? control[controlNext] : bulk[bulkNext];
+            size_t remaining = item.size() - item.index;
+            if (item.file) {
+                flags |= MSG_MORE; // the file follows right away, let the header share its first segment
+                break;
+            }
+            if (iovCount > 0 && zeroCopyThreshold > 0 && remaining >= zeroCopyThreshold) {
+                break; // leave large payloads for the zero copy path
+            }
+            if (lane == Lane::CONTROL) {
+                ++controlNext;
+            } else {
+                ++bulkNext;
+            }
+            if (partial == Lane::NONE) {
+                noteStart(lane, remaining, bulkNext < bulk.size(), overtaken);
+            }
+            partial = Lane::NONE;
+            context.iovecs[iovCount].iov_base = const_cast<char*>(item.data.data()) + item.index;
+            context.iovecs[iovCount].iov_len = remaining;
+            batchBytes += remaining;
+        }
+        msghdr msg{};
+        msg.msg_iov = context.iovecs.data();
+        msg.msg_iovlen = iovCount;
+        ssize_t sent = ::sendmsg(socketFd, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FlushResult::AGAIN;
+            }
+            return FlushResult::ERROR;
+        }
+        consume(static_cast<size_t>(sent), context);
+        bytesSent += static_cast<size_t>(sent);
+        context.counters.copyBytes.fetch_add(static_cast<uint64_t>(sent), std::memory_order_relaxed);
+        if (static_cast<size_t>(sent) < batchBytes) {
+            // short write, the socket buffer is full so another call would only return EAGAIN
+            return FlushResult::AGAIN;
+        }
+    }
+    return FlushResult::DRAINED;
+}
+
+void SendQueue::reapCompletions(int socketFd, flushContext& context)
+{
+    if (!lanes_) {
+        return;
+    }
+    auto& inflight = lanes_->inflight;
+    while (!inflight.empty()) {
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(socketFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // EAGAIN, nothing more reported yet
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            bool isRecvErr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            if (!isRecvErr) {
+                continue;
+            }
+            auto* err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cmsg));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // [ee_info, ee_data] is an inclusive range of completed sequence numbers
+            uint32_t lo = err->ee_info;
+            uint32_t span = err->ee_data - lo;
+            uint64_t completed = static_cast<uint64_t>(span) + 1;
+            for (auto& entry : inflight) {
+                if (entry.seq - lo <= span) {
+                    entry.done = true;
+                }
+            }
+            context.counters.zeroCopyCompletions.fetch_add(completed, std::memory_order_relaxed);
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                context.counters.zeroCopyKernelCopied.fetch_add(completed, std::memory_order_relaxed);
+            }
+        }
+    }
+    while (!inflight.empty() && inflight.front().done) {
+        inflight.pop_front();
+    }
+}
+
+void SendQueue::consume(size_t bytes, const flushContext& context)
+{
+    while (!empty()) {
+        auto& control = lanes_->control;
+        auto& bulk = lanes_->bulk;
+        Lane lane = partial_ != Lane::NONE ? partial_ : pickLane(!control.empty(), !bulk.empty(), overtaken_, context.controlBurstBytes);
+        auto& items = lane == Lane::CONTROL ? control : bulk;
+        auto& item = items.front();
+        size_t remaining = item.size() - item.index;
+        if (bytes < remaining && bytes == 0) {
+            return;
+        }
+        if (partial_ == Lane::NONE) {
+            noteStart(lane, remaining, lane == Lane::CONTROL ? !bulk.empty() : true, overtaken_);
+        }
+        if (!item.file) {
+            queuedBytes_ -= std::min(bytes, remaining);
+        }
+        if (bytes < remaining) {
+            item.index += bytes;
+            partial_ = lane;
+            return;
+        }
+        bytes -= remaining;
+        items.pop_front();
+        partial_ = Lane::NONE;
+    }
+}
+}
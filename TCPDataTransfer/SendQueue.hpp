@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "PayloadBuffer.hpp"
+#include "BufferPool.hpp"
+
+namespace TCPDataTransfer {
+/**
+ * Byte range of a regular file streamed to the socket with sendfile. The descriptor is a private
+ * duplicate, closed once the range is sent or dropped, so the caller may close its own right away.
+ */
+struct fileRange {
+    int fd;
+    off_t offset;
+    size_t len;
+
+    fileRange(int fd, off_t offset, size_t len) : fd(fd), offset(offset), len(len) {}
+    ~fileRange() { ::close(fd); }
+    fileRange(const fileRange&) = delete;
+    fileRange& operator=(const fileRange&) = delete;
+};
+
+struct pendingData {
+    PayloadBuffer data;
+    size_t index{0};
+    std::unique_ptr<fileRange> file; // set for file entries, data stays empty then
+    explicit pendingData(PayloadBuffer d) : data(std::move(d)) {}
+    explicit pendingData(std::unique_ptr<fileRange> f) : file(std::move(f)) {}
+    size_t size() const { return file ? file->len : data.size(); }
+};
+
+/**
+ * Control frames (heartbeats, acks, presence) overtake queued bulk data at entry boundaries, so each
+ * sendData has to carry whole frames. Within one class the send order is kept.
+ */
+enum class SendPriority { BULK, CONTROL };
+
+struct sendStats {
+    uint64_t copyBytes{0};
+    uint64_t zeroCopyBytes{0};
+    uint64_t zeroCopySends{0};
+    uint64_t zeroCopyCompletions{0};
+    uint64_t zeroCopyKernelCopied{0};
+    uint64_t zeroCopyFallbacks{0};
+    uint64_t fileBytes{0};
+
+    sendStats& operator+=(const sendStats& other)
+    {
+        copyBytes += other.copyBytes;
+        zeroCopyBytes += other.zeroCopyBytes;
+        zeroCopySends += other.zeroCopySends;
+        zeroCopyCompletions += other.zeroCopyCompletions;
+        zeroCopyKernelCopied += other.zeroCopyKernelCopied;
+        zeroCopyFallbacks += other.zeroCopyFallbacks;
+        fileBytes += other.fileBytes;
+        return *this;
+    }
+};
+
+/**
+ * Written by the owning consumer thread only, read relaxed by stats snapshots.
+ */
+struct sendCounters {
+    std::atomic<uint64_t> copyBytes{0};
+    std::atomic<uint64_t> zeroCopyBytes{0};
+    std::atomic<uint64_t> zeroCopySends{0};
+    std::atomic<uint64_t> zeroCopyCompletions{0};
+    std::atomic<uint64_t> zeroCopyKernelCopied{0}; // completions where the kernel fell back to copying
+    std::atomic<uint64_t> zeroCopyFallbacks{0};    // MSG_ZEROCOPY refused, sent through the copy path
+    std::atomic<uint64_t> fileBytes{0};            // sent with sendfile, straight from the page cache
+
+    sendStats snapshot() const
+    {
+        sendStats stats;
+        stats.copyBytes = copyBytes.load(std::memory_order_relaxed);
+        stats.zeroCopyBytes = zeroCopyBytes.load(std::memory_order_relaxed);
+        stats.zeroCopySends = zeroCopySends.load(std::memory_order_relaxed);
+        stats.zeroCopyCompletions = zeroCopyCompletions.load(std::memory_order_relaxed);
+        stats.zeroCopyKernelCopied = zeroCopyKernelCopied.load(std::memory_order_relaxed);
+        stats.zeroCopyFallbacks = zeroCopyFallbacks.load(std::memory_order_relaxed);
+        stats.fileBytes = fileBytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+/**
+ * Consumer owned state shared by every SendQueue flushed on that consumer's thread.
+ */
+struct flushContext {
+    std::vector<struct iovec> iovecs; // scratch space reused across flushes to avoid allocations
+    std::atomic<size_t> zeroCopyThreshold{0}; // payloads at least this large use MSG_ZEROCOPY, 0 disables it
+    size_t controlBurstBytes{64 << 10}; // control bytes that may overtake waiting bulk data before one bulk entry goes
+    sendCounters counters;
+};
+
+/**
+ * Per-socket FIFO of outbound buffers. flush() gathers up to IOV_MAX queued buffers into one
+ * sendmsg, advances through partial writes across buffer boundaries and pops every buffer as
+ * soon as its last byte is handed to the kernel.
+ * Control buffers sit in their own lane and go ahead of bulk ones, but never into the middle of a
+ * buffer already partly sent. Once controlBurstBytes went ahead of waiting bulk data, one bulk buffer goes next.
+ * Buffers sent with MSG_ZEROCOPY are kept alive until reapCompletions() sees the kernel release them.
+ * File entries are streamed with sendfile in chunks between the buffers around them, the queue only
+ * remembers how far the file got, so a transfer of any size resumes on the next flush in constant memory.
+ * The lanes are allocated by the first push, a queue that never sent anything holds no storage.
+ */
+class SendQueue {
+public:
+    enum class FlushResult { DRAINED, AGAIN, ERROR };
+
+    /**
+     * @param pool backs the queue's own storage, null uses the global allocator.
+     */
+    explicit SendQueue(BufferPool* pool = nullptr) : lanes_(nullptr, laneDeleter{pool}) {}
+    void push(PayloadBuffer data, SendPriority priority = SendPriority::BULK);
+    /**
+     * Copies a small payload into the segment open at the queue tail, so a burst of small frames leaves as
+     * one contiguous buffer instead of one iovec each. A full segment is followed by a new one of segmentBytes,
+     * drained segments are reused. Payloads larger than segmentBytes are queued as they are.
+     */
+    void pushCoalesced(PayloadBuffer data, size_t segmentBytes);
+    /**
+     * Queues a file range in the bulk lane. Its bytes are not part of queuedBytes(), they take no memory here.
+     */
+    void pushFile(std::unique_ptr<fileRange> file);
+    bool empty() const { return !lanes_ || (lanes_->bulk.empty() && lanes_->control.empty()); }
+    size_t queuedBytes() const { return queuedBytes_; }
+    size_t size() const { return lanes_ ? lanes_->bulk.size() + lanes_->control.size() : 0; }
+    bool hasZeroCopyInflight() const { return lanes_ && !lanes_->inflight.empty(); }
+    /**
+     * Gives the lanes and the coalescing segment back once nothing is queued or waiting for a zero copy
+     * completion, the next push allocates them again. For connections that send rarely.
+     */
+    void release();
+
+    /**
+     * Writes as much as the socket accepts.
+     * @return DRAINED when the queue is empty, AGAIN when the socket buffer is full, ERROR with errno set otherwise.
+     */
+    FlushResult flush(int socketFd, flushContext& context, size_t& bytesSent);
+
+    /**
+     * Drains MSG_ZEROCOPY completion notifications from the socket error queue.
+     */
+    void reapCompletions(int socketFd, flushContext& context);
+private:
+    struct zeroCopyInflight {
+        uint32_t seq;
+        bool done;
+        PayloadBuffer data;
+    };
+
+    struct laneStorage {
+        std::deque<pendingData, PoolAllocator<pendingData>> bulk;
+        std::deque<pendingData, PoolAllocator<pendingData>> control;
+        std::deque<zeroCopyInflight, PoolAllocator<zeroCopyInflight>> inflight;
+
+        explicit laneStorage(BufferPool* pool)
+            : bulk(PoolAllocator<pendingData>(pool)), control(PoolAllocator<pendingData>(pool)),
+              inflight(PoolAllocator<zeroCopyInflight>(pool)) {}
+    };
+
+    struct laneDeleter {
+        BufferPool* pool;
+        void operator()(laneStorage* lanes) const;
+    };
+
+    enum class Lane : uint8_t { NONE, BULK, CONTROL };
+
+    static Lane pickLane(bool controlWaiting, bool bulkWaiting, size_t overtaken, size_t burstBytes)
+    {
+        if (controlWaiting && (!bulkWaiting || overtaken < burstBytes)) {
+            return Lane::CONTROL;
+        }
+        return bulkWaiting ? Lane::BULK : Lane::NONE;
+    }
+    static void noteStart(Lane lane, size_t bytes, bool bulkWaiting, size_t& overtaken)
+    {
+        if (lane == Lane::BULK) {
+            overtaken = 0;
+        } else if (bulkWaiting) {
+            overtaken += bytes;
+        }
+    }
+    laneStorage& lanes();
+    pendingData& head(const flushContext& context);
+    void consume(size_t bytes, const flushContext& context);
+    bool useZeroCopy(int socketFd, const flushContext& context);
+    ssize_t sendZeroCopy(int socketFd, flushContext& context);
+    ssize_t sendFileChunk(int socketFd, size_t chunk, flushContext& context);
+private:
+    std::unique_ptr<laneStorage, laneDeleter> lanes_; // null until the first push and after release()
+    Lane partial_{Lane::NONE}; // lane whose front buffer is partly sent, it finishes before anything else starts
+    size_t overtaken_{0};      // control bytes started while bulk data waited, since the last bulk buffer started
+    size_t queuedBytes_{0}; // buffered bytes only, file entries are read from the page cache when sent
+    std::shared_ptr<std::string> segment_; // last coalescing segment, only appended to while it is the queue tail
+    uint32_t zeroCopySeq_{0};
+    bool zeroCopyEnabled_{false};
+    bool zeroCopyUnsupported_{false};
+};
+}
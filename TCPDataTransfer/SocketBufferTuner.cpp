@@ -0,0 +1,88 @@
+#include "SocketBufferTuner.hpp"
+#include "LogMacro.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h> // the glibc tcp_info stops before tcpi_notsent_bytes
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+namespace TCPDataTransfer {
+namespace {
+const uint32_t SNDBUF_GRANULE = 4 << 10;
+
+uint32_t roundUp(uint64_t value)
+{
+    return static_cast<uint32_t>(std::min<uint64_t>((value + SNDBUF_GRANULE - 1) / SNDBUF_GRANULE * SNDBUF_GRANULE, UINT32_MAX));
+}
+}
+
+SocketBufferTuner::SocketBufferTuner(const socketBufferOptions& options) : options_(options)
+{
+    options_.minSndBuf = std::max<uint32_t>(options_.minSndBuf, SNDBUF_GRANULE);
+    options_.maxSndBuf = std::max(options_.maxSndBuf, options_.minSndBuf);
+    options_.initialSndBuf = std::clamp(options_.initialSndBuf, options_.minSndBuf, options_.maxSndBuf);
+}
+
+uint32_t SocketBufferTuner::sampleIntervalUs(const tcpSample& sample) const
+{
+    // the window moves once per round trip, sampling faster only reads the same value again
+    return std::max(options_.sampleIntervalMs * 1000, sample.rttUs * 8);
+}
+
+uint32_t SocketBufferTuner::setup(int socketFd) const
+{
+    if (options_.notSentLowat > 0) {
+        int lowat = static_cast<int>(options_.notSentLowat);
+        if (setsockopt(socketFd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+            LOG_WARNING("setsockopt TCP_NOTSENT_LOWAT failed for socket fd " << socketFd << ": " << strerror(errno));
+        }
+    }
+    int sndBuf = static_cast<int>(options_.initialSndBuf);
+    if (setsockopt(socketFd, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) < 0) {
+        LOG_WARNING("setsockopt SO_SNDBUF failed for socket fd " << socketFd << ": " << strerror(errno));
+        return 0;
+    }
+    return options_.initialSndBuf;
+}
+
+uint32_t SocketBufferTuner::target(const tcpSample& sample) const
+{
+    uint64_t inflight = static_cast<uint64_t>(sample.cwnd) * sample.mss;
+    return std::clamp(roundUp(inflight * 2 + options_.notSentLowat), options_.minSndBuf, options_.maxSndBuf);
+}
+
+uint32_t SocketBufferTuner::retune(int socketFd, uint32_t sndBuf, const tcpSample& sample, bool writeBlocked) const
+{
+    uint32_t wanted = target(sample);
+    // a blocked writer with plenty unsent in the kernel waits for the window, a larger buffer would not help it
+    bool bufferLimited = writeBlocked && sample.notSentBytes < std::max(options_.notSentLowat, sample.mss);
+    bool grow = bufferLimited && wanted > sndBuf;
+    bool shrink = wanted < sndBuf / 2;
+    if (!grow && !shrink) {
+        return sndBuf;
+    }
+    // the kernel doubles the value for its bookkeeping, the target already leaves room for that
+    int value = static_cast<int>(wanted);
+    if (setsockopt(socketFd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0) {
+        return sndBuf;
+    }
+    return wanted;
+}
+
+bool SocketBufferTuner::sample(int socketFd, tcpSample& sample)
+{
+    struct tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(socketFd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return false;
+    }
+    sample.rttUs = info.tcpi_rtt;
+    sample.cwnd = info.tcpi_snd_cwnd;
+    sample.mss = info.tcpi_snd_mss;
+    // older kernels return a shorter struct, fields past len stay zero
+    sample.notSentBytes = len >= offsetof(struct tcp_info, tcpi_notsent_bytes) + sizeof(info.tcpi_notsent_bytes) ? info.tcpi_notsent_bytes : 0;
+    return true;
+}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+namespace TCPDataTransfer {
+/**
+ * Per connection SO_SNDBUF sizing. Adaptive sockets start small and follow what the path can carry,
+ * read from TCP_INFO while they send, instead of every socket reserving the fixed 1MB.
+ */
+struct socketBufferOptions {
+    bool adaptive{false};
+    uint32_t initialSndBuf{32 << 10};
+    uint32_t minSndBuf{16 << 10};
+    uint32_t maxSndBuf{4 << 20};
+    uint32_t sampleIntervalMs{200}; // a sending connection is re-sampled at most this often, and never within 8 RTTs
+    /**
+     * TCP_NOTSENT_LOWAT, the kernel keeps at most about this many unsent bytes and the rest waits in the
+     * send queue, where control frames can still overtake it. 0 leaves the kernel default.
+     */
+    uint32_t notSentLowat{16 << 10};
+};
+
+struct tcpSample {
+    uint32_t rttUs{0};
+    uint32_t cwnd{0};         // segments
+    uint32_t mss{0};
+    uint32_t notSentBytes{0}; // written but not yet sent, 0 on kernels that do not report it
+};
+
+class SocketBufferTuner {
+public:
+    explicit SocketBufferTuner(const socketBufferOptions& options);
+
+    bool adaptive() const { return options_.adaptive; }
+    uint32_t sampleIntervalUs(const tcpSample& sample) const;
+    /**
+     * Applies the initial size and the low water mark to a socket joining the consumer.
+     * @return the SO_SNDBUF value requested, 0 when it could not be set.
+     */
+    uint32_t setup(int socketFd) const;
+    /**
+     * Resizes SO_SNDBUF towards the target for the sample. Growing only happens while the writer is blocked
+     * and the kernel holds little unsent data, so the buffer and not the window held it back. Shrinking
+     * happens once the target fell below half the current size.
+     * @return the new size, or sndBuf when it stays.
+     */
+    uint32_t retune(int socketFd, uint32_t sndBuf, const tcpSample& sample, bool writeBlocked) const;
+    /**
+     * Twice the congestion window, so the window can keep growing, plus the unsent bytes the kernel may hold.
+     */
+    uint32_t target(const tcpSample& sample) const;
+    static bool sample(int socketFd, tcpSample& sample);
+private:
+    socketBufferOptions options_;
+};
+}
@@ -0,0 +1,91 @@
+#include "StripedTCPDataSender.hpp"
+#include "LogMacro.hpp"
+
+namespace TCPDataTransfer {
+StripedTCPDataSender::StripedTCPDataSender(const senderOptions& options)
+{
+    senderOptions stripeOptions = options;
+    stripeOptions.stripes = 1;
+    stripes_.reserve(options.stripes);
+    for (uint16_t i = 0; i < options.stripes; ++i) {
+        stripes_.push_back(std::make_unique<TCPDataSenderImpl>(stripeOptions));
+    }
+    LOG_INFO("StripedTCPDataSender created with " << stripes_.size() << " stripes");
+}
+
+StripedTCPDataSender::~StripedTCPDataSender()
+{
+    LOG_INFO("StripedTCPDataSender destroyed.");
+}
+
+bool StripedTCPDataSender::open(const std::string& ip, int port)
+{
+    for (size_t i = 0; i < stripes_.size(); ++i) {
+        if (!stripes_[i]->open(ip, port)) {
+            LOG_ERROR("Stripe " << i << " failed to connect to " << ip << ":" << port << ", closing " << i << " open stripes.");
+            for (size_t opened = 0; opened < i; ++opened) {
+                stripes_[opened]->close();
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// a racy snapshot is enough, the stripe picked only has to be among the least loaded
+TCPDataSenderImpl* StripedTCPDataSender::leastQueued()
+{
+    size_t start = nextStripe_.fetch_add(1, std::memory_order_relaxed);
+    TCPDataSenderImpl* best = nullptr;
+    size_t bestQueued = 0;
+    for (size_t i = 0; i < stripes_.size(); ++i) {
+        TCPDataSenderImpl* stripe = stripes_[(start + i) % stripes_.size()].get();
+        if (!stripe->healthy()) {
+            continue;
+        }
+        size_t queued = stripe->queuedBytes();
+        if (!best || queued < bestQueued) {
+            best = stripe;
+            bestQueued = queued;
+            if (queued == 0) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+bool StripedTCPDataSender::send(const char* data, size_t length)
+{
+    TCPDataSenderImpl* stripe = leastQueued();
+    if (!stripe) {
+        LOG_ERROR("No open stripe left to send " << length << " bytes.");
+        return false;
+    }
+    return stripe->send(data, length);
+}
+
+// keys never fail over, moving a key to another stream could reorder its messages
+bool StripedTCPDataSender::send(uint64_t key, const char* data, size_t length)
+{
+    uint64_t mixed = key * 0x9E3779B97F4A7C15ULL; // sequential keys land on different stripes
+    return stripes_[(mixed >> 32) % stripes_.size()]->send(data, length);
+}
+
+bool StripedTCPDataSender::flush()
+{
+    bool flushed = true;
+    for (auto& stripe : stripes_) {
+        flushed = stripe->flush() && flushed;
+    }
+    return flushed;
+}
+
+bool StripedTCPDataSender::close()
+{
+    for (auto& stripe : stripes_) {
+        stripe->close();
+    }
+    return true;
+}
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "TCPDataSenderImpl.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace TCPDataTransfer {
+/**
+ * Opens senderOptions::stripes connections to one endpoint. Every stripe is a TCPDataSenderImpl with its own
+ * buffer and locks, so threads sending on different stripes never contend and a stalled stream only holds
+ * back the sends routed to it.
+ */
+class StripedTCPDataSender : public TCPDataSender {
+public:
+    explicit StripedTCPDataSender(const senderOptions& options);
+    ~StripedTCPDataSender();
+    /**
+     * All stripes or none, a stripe that fails to connect closes the ones already open.
+     */
+    bool open(const std::string& ip, int port) override;
+    bool send(const char* data, size_t length) override;
+    bool send(uint64_t key, const char* data, size_t length) override;
+    bool flush() override;
+    bool close() override;
+private:
+    TCPDataSenderImpl* leastQueued();
+private:
+    std::vector<std::unique_ptr<TCPDataSenderImpl>> stripes_;
+    std::atomic<size_t> nextStripe_{0}; // rotates the scan start so idle stripes share the sends
+};
+}
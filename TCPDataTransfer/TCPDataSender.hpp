@@ -1,17 +1,48 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <memory>
-#include "TCPDataSenderImpl.hpp"
+#include <string>
 
 namespace TCPDataTransfer {
+struct senderOptions {
+    /**
+     * Buffered senders append messages to an internal buffer and write them in batches, send() only
+     * makes a syscall once flushBytes are pending. Unbuffered senders write every message right away.
+     */
+    bool buffered{false};
+    size_t flushBytes{64 << 10};       // pending bytes that trigger a flush, larger messages skip the copy
+    uint32_t flushLatencyUs{200};      // longest a buffered byte waits for auto-flush, 0 flushes only on size or flush()
+    size_t maxBufferedBytes{16 << 20}; // send fails while this many bytes are still pending
+    uint32_t sendTimeoutMs{3000};      // how long a write waits for a full socket buffer to drain
+    uint16_t stripes{1};               // connections opened to the same endpoint, sends are spread across them
+    uint32_t sendBufferBytes{1 << 20}; // SO_SNDBUF per connection, 0 leaves the size to the kernel's autotuning
+};
+
 class TCPDataSender {
 public:
     virtual bool open(const std::string& ip, int port) = 0;
+    /**
+     * Either writes all bytes or fails, a message is never cut short silently. A failure after part of a
+     * message reached the kernel leaves the stream torn, the sender then refuses further sends.
+     */
     virtual bool send(const char* data, size_t length) = 0;
+    /**
+     * Sends with the same key keep their order, striped senders pin a key to one connection. A striped
+     * sender hands plain send() to the least loaded connection, so two plain sends may arrive in either order.
+     */
+    virtual bool send(uint64_t key, const char* data, size_t length) = 0;
+    /**
+     * Writes every buffered byte, waiting at most sendTimeoutMs for the socket to drain. No-op when unbuffered.
+     */
+    virtual bool flush() = 0;
     virtual bool close() = 0;
     virtual ~TCPDataSender() = default;
-    
-    static std::shared_ptr<TCPDataSender> create();
+
+    /**
+     * More than one stripe returns a sender that owns that many connections, each with its own buffer and locks.
+     */
+    static std::shared_ptr<TCPDataSender> create(const senderOptions& options = senderOptions());
 };
 }
@@ -1,18 +1,34 @@
 #include "TCPDataSenderImpl.hpp"
+#include "StripedTCPDataSender.hpp"
 #include "LogMacro.hpp"
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/tcp.h>
+#include <cerrno>
+#include <cstring>
 
 namespace TCPDataTransfer {
-TCPDataSenderImpl::TCPDataSenderImpl() : socketfd_(-1), isOpen_(false)
+std::shared_ptr<TCPDataSender> TCPDataSender::create(const senderOptions& options)
 {
-    LOG_INFO("TCPDataSenderImpl created.");
+    if (options.stripes > 1) {
+        return std::make_shared<StripedTCPDataSender>(options);
+    }
+    return std::make_shared<TCPDataSenderImpl>(options);
+}
+
+TCPDataSenderImpl::TCPDataSenderImpl(const senderOptions& options) : options_(options), socketfd_(-1), isOpen_(false)
+{
+    LOG_INFO("TCPDataSenderImpl created, " << (options_.buffered ? "buffered" : "unbuffered"));
 }
 
 TCPDataSenderImpl::~TCPDataSenderImpl()
 {
+    if (isOpen_) {
+        close();
+    }
     LOG_INFO("TCPDataSenderImpl destroyed.");
 }
 
@@ -33,11 +49,27 @@ bool TCPDataSenderImpl::open(const std::string& ip, int port)
     serverAddr.sin_port = htons(port);
     inet_pton(AF_INET, ip.c_str(), &serverAddr.sin_addr);
     if (connect(socketfd_, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        LOG_ERROR("Connection to server failed.");
-        close();
-        return false;
+        int error = errno;
+        if (error == EINPROGRESS) {
+            // the socket is already non-blocking, wait for the handshake as long as a send would wait
+            error = waitWritable() ? 0 : ETIMEDOUT;
+            socklen_t errLen = sizeof(error);
+            if (error == 0 && getsockopt(socketfd_, SOL_SOCKET, SO_ERROR, &error, &errLen) < 0) {
+                error = errno;
+            }
+        }
+        if (error != 0) {
+            LOG_ERROR("Connection to server failed: " << strerror(error));
+            ::close(socketfd_);
+            socketfd_ = -1;
+            return false;
+        }
     }
+    broken_ = false;
     isOpen_ = true;
+    if (options_.buffered && options_.flushLatencyUs > 0) {
+        flushThread_ = std::thread(&TCPDataSenderImpl::flushLoop, this);
+    }
     LOG_INFO("Connected to server, ip: " << ip << ", port: " << port);
     return true;
 }
@@ -47,8 +79,11 @@ void TCPDataSenderImpl::optimizeSocket()
     int opt = 1; // no Nagle
     setsockopt(socketfd_, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt));
 
-    int sndBuf = 1 << 20; // 1MB
-    setsockopt(socketfd_, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+    // a fixed size turns off the kernel's autotuning, which grows the buffer with the window and starts small
+    if (options_.sendBufferBytes > 0) {
+        int sndBuf = static_cast<int>(options_.sendBufferBytes);
+        setsockopt(socketfd_, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+    }
 
     fcntl(socketfd_, F_SETFL, O_NONBLOCK); // non-blocking
 
@@ -62,31 +97,185 @@ void TCPDataSenderImpl::optimizeSocket()
 }
 
 bool TCPDataSenderImpl::send(const char* data, size_t length)
+{
+    if (!isOpen_ || broken_) {
+        LOG_ERROR("Socket is not open.");
+        return false;
+    }
+    if (!options_.buffered || length >= options_.flushBytes) {
+        // large messages go out behind the buffered bytes in one writev instead of being copied
+        queuedBytes_.fetch_add(length, std::memory_order_relaxed);
+        return flushPending(data, length);
+    }
+    bool full = false;
+    bool wasEmpty = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_.size() + length > options_.maxBufferedBytes) {
+            LOG_ERROR("Send buffer full, " << pending_.size() << " bytes pending, dropping " << length << " bytes.");
+            return false;
+        }
+        queuedBytes_.fetch_add(length, std::memory_order_relaxed);
+        wasEmpty = pending_.empty();
+        if (wasEmpty) {
+            oldestPending_ = std::chrono::steady_clock::now();
+        }
+        pending_.append(data, length);
+        full = pending_.size() >= options_.flushBytes;
+    }
+    if (full) {
+        return flushPending(nullptr, 0);
+    }
+    if (wasEmpty && flushThread_.joinable()) {
+        flushCv_.notify_one();
+    }
+    return true;
+}
+
+bool TCPDataSenderImpl::send(uint64_t key, const char* data, size_t length)
+{
+    (void)key; // one connection keeps every order
+    return send(data, length);
+}
+
+bool TCPDataSenderImpl::flush()
 {
     if (!isOpen_) {
         LOG_ERROR("Socket is not open.");
         return false;
     }
-    ssize_t bytesSent = ::send(socketfd_, data, length, MSG_NOSIGNAL);
-    if (bytesSent < 0) {
-        LOG_ERROR("Failed to send data.");
+    return flushPending(nullptr, 0);
+}
+
+// writes the pending bytes followed by tail, whoever holds writeMutex_ writes everything pending at that moment
+bool TCPDataSenderImpl::flushPending(const char* tail, size_t tailLength)
+{
+    std::lock_guard<std::mutex> writeLock(writeMutex_);
+    if (broken_ || socketfd_ == -1) { // a writer that got past isOpen_ just before close()
+        queuedBytes_.fetch_sub(tailLength, std::memory_order_relaxed);
         return false;
     }
+    {
+        // the drained inflight_ goes back as pending_, so the two buffers keep their capacity
+        std::lock_guard<std::mutex> lock(mutex_);
+        inflight_.swap(pending_);
+    }
+    struct iovec iov[2];
+    int iovCount = 0;
+    if (!inflight_.empty()) {
+        iov[iovCount++] = {const_cast<char*>(inflight_.data()), inflight_.size()};
+    }
+    if (tailLength > 0) {
+        iov[iovCount++] = {const_cast<char*>(tail), tailLength};
+    }
+    bool sent = iovCount == 0 || writeAll(iov, iovCount);
+    if (!sent) {
+        LOG_ERROR("Sender stream broken, " << inflight_.size() + tailLength << " bytes not fully sent.");
+        broken_ = true;
+    }
+    queuedBytes_.fetch_sub(inflight_.size() + tailLength, std::memory_order_relaxed);
+    inflight_.clear();
+    return sent;
+}
+
+// resumes behind every partial write, waiting for the socket to drain whenever the kernel buffer is full
+bool TCPDataSenderImpl::writeAll(struct iovec* iov, int iovCount)
+{
+    while (iovCount > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = static_cast<size_t>(iovCount);
+        ssize_t bytesSent = ::sendmsg(socketfd_, &msg, MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable()) {
+                continue;
+            }
+            LOG_ERROR("Failed to send data: " << strerror(errno));
+            return false;
+        }
+        size_t left = static_cast<size_t>(bytesSent);
+        while (iovCount > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --iovCount;
+        }
+        if (iovCount > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
     return true;
 }
 
+// errors also end the wait, the next syscall reports them
+bool TCPDataSenderImpl::waitWritable()
+{
+    struct pollfd pfd{socketfd_, POLLOUT, 0};
+    while (true) {
+        int ready = ::poll(&pfd, 1, static_cast<int>(options_.sendTimeoutMs));
+        if (ready > 0) {
+            return true;
+        }
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+void TCPDataSenderImpl::flushLoop()
+{
+    auto latency = std::chrono::microseconds(options_.flushLatencyUs);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (isOpen_) {
+        if (pending_.empty() || broken_) {
+            flushCv_.wait(lock);
+            continue;
+        }
+        auto deadline = oldestPending_ + latency;
+        if (std::chrono::steady_clock::now() < deadline) {
+            flushCv_.wait_until(lock, deadline);
+            continue;
+        }
+        lock.unlock();
+        flushPending(nullptr, 0);
+        lock.lock();
+    }
+}
+
 bool TCPDataSenderImpl::close()
 {
-    if (!isOpen_) {
+    bool wasOpen = false;
+    {
+        // under mutex_ so the flush thread cannot miss it between its check and its wait
+        std::lock_guard<std::mutex> lock(mutex_);
+        wasOpen = isOpen_.exchange(false);
+    }
+    if (!wasOpen) {
         LOG_ERROR("Socket is already closed.");
         return true;
     }
-    if (socketfd_ != -1) {
-        ::close(socketfd_);
-        socketfd_ = -1;
+    flushCv_.notify_all();
+    if (flushThread_.joinable()) {
+        flushThread_.join();
+    }
+    // whatever is still buffered goes out before the socket does
+    flushPending(nullptr, 0);
+    {
+        // writers still inside flushPending finish on the open socket, later ones see -1
+        std::lock_guard<std::mutex> writeLock(writeMutex_);
+        if (socketfd_ != -1) {
+            ::close(socketfd_);
+            socketfd_ = -1;
+        }
     }
-    isOpen_ = false;
     LOG_INFO("Socket closed.");
     return true;
 }
-}
\ No newline at end of file
+}
@@ -1,23 +1,46 @@
 #pragma once
 #include "TCPDataSender.hpp"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sys/uio.h>
 
 namespace TCPDataTransfer {
 class TCPDataSenderImpl : public TCPDataSender {
 public:
-    TCPDataSenderImpl();
+    explicit TCPDataSenderImpl(const senderOptions& options = senderOptions());
     ~TCPDataSenderImpl();
     bool open(const std::string& ip, int port) override;
     bool send(const char* data, size_t length) override;
+    bool send(uint64_t key, const char* data, size_t length) override;
+    bool flush() override;
     bool close() override;
+    /**
+     * Bytes accepted by send() that have not reached the kernel yet, including a write in progress.
+     */
+    size_t queuedBytes() const { return queuedBytes_.load(std::memory_order_relaxed); }
+    bool healthy() const { return isOpen_ && !broken_; }
 private:
     void optimizeSocket();
+    bool waitWritable();
+    bool writeAll(struct iovec* iov, int iovCount);
+    bool flushPending(const char* tail, size_t tailLength);
+    void flushLoop();
 private:
+    senderOptions options_;
     int socketfd_;
     std::atomic_bool isOpen_;
+    std::atomic_bool broken_{false}; // a write failed part way, the peer would see a torn message
+    std::atomic<size_t> queuedBytes_{0};
+    // producers only take mutex_ to append, so they keep batching while a flush waits on the socket
+    std::mutex mutex_;
+    std::condition_variable flushCv_;
+    std::string pending_;
+    std::chrono::steady_clock::time_point oldestPending_;
+    std::mutex writeMutex_; // serializes writers, held across the whole write so messages never interleave
+    std::string inflight_;  // pending_ taken over by the current flush, only touched under writeMutex_
+    std::thread flushThread_;
 };
-
-std::shared_ptr<TCPDataSender> TCPDataSender::create() {
-    return std::make_shared<TCPDataSenderImpl>();
 }
-}
\ No newline at end of file
@@ -14,6 +14,17 @@ TCPDataTransfer& TCPDataTransfer::instance() {
     return instance;
 }
 
+consumerPoolOptions& TCPDataTransfer::poolOptions()
+{
+    static consumerPoolOptions options;
+    return options;
+}
+
+void TCPDataTransfer::setPoolOptions(const consumerPoolOptions& options)
+{
+    poolOptions() = options;
+}
+
 TCPDataTransfer::TCPDataTransfer()
 {
     LOG_INFO("TCPDataTransfer constructor called.");
@@ -27,34 +38,138 @@ TCPDataTransfer::~TCPDataTransfer()
 
 connectInfo TCPDataTransfer::buildConnection(uint64_t userId, const std::string& clientIp, int clientPort)
 {
-    if (connNum >= MAX_CONNECTIONS) {
-        LOG_ERROR("Too many connections, cannot build new connection in this server.");
-        return connectInfo{}; 
-    }
+    return buildConnections({connectRequest{userId, clientIp, clientPort}}).front();
+}
+
+std::vector<connectInfo> TCPDataTransfer::buildConnections(const std::vector<connectRequest>& requests)
+{
+    std::vector<connectInfo> results(requests.size());
+    std::vector<connRecord> records(requests.size());
+    std::vector<bool> fresh(requests.size(), false);
+    std::vector<bool> existing(requests.size(), false);
     {
         std::shared_lock<std::shared_mutex> locl(connMutex_);
-        if (connections_.find(userId) != connections_.end()) {
-            LOG_WARNING("Connection for userId " << userId << ", already exists.");
-            return connections_[userId];
+        for (size_t i = 0; i < requests.size(); ++i) {
+            auto it = connections_.find(requests[i].userId);
+            if (it != connections_.end()) {
+                LOG_WARNING("Connection for userId " << requests[i].userId << ", already exists.");
+                results[i] = toConnectInfo(it->first, it->second);
+                existing[i] = true;
+            }
         }
     }
-    connNum++;
-    connectInfo newConn;    
-    if (!buildSocket(newConn, clientIp, clientPort)) {
-        connNum--;  
-        return connectInfo{};
+    // only non-blocking syscalls here, the consumers finish the connects
+    for (size_t i = 0; i < requests.size(); ++i) {
+        if (existing[i]) {
+            continue;
+        }
+        if (connNum.fetch_add(1) >= maxConnections_) {
+            connNum--;
+            LOG_ERROR("Too many connections, cannot build new connection for userId " << requests[i].userId << " in this server.");
+            continue;
+        }
+        if (!buildSocket(records[i], requests[i].clientIp, requests[i].clientPort)) {
+            connNum--;
+            continue;
+        }
+        records[i].clientPort = static_cast<uint16_t>(requests[i].clientPort);
+        fresh[i] = true;
+    }
+    // registered before the consumers see the sockets, so a fast connect failure always finds its entry
+    {
+        std::unique_lock<std::shared_mutex> locl(connMutex_);
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (!fresh[i]) {
+                continue;
+            }
+            auto [it, inserted] = connections_.emplace(requests[i].userId, records[i]);
+            if (!inserted) {
+                LOG_WARNING("Connection for userId " << requests[i].userId << ", already exists.");
+                ::close(records[i].socketFd);
+                connNum--;
+                results[i] = toConnectInfo(it->first, it->second);
+                fresh[i] = false;
+            }
+        }
+    }
+    for (size_t i = 0; i < requests.size(); ++i) {
+        if (!fresh[i]) {
+            continue;
+        }
+        if (epollConsumerPool_->addUserSocket(records[i].socketFd, requests[i].userId, true)) {
+            results[i] = toConnectInfo(requests[i].userId, records[i]);
+            continue;
+        }
+        ::close(records[i].socketFd);
+        {
+            std::unique_lock<std::shared_mutex> locl(connMutex_);
+            connections_.erase(requests[i].userId);
+        }
+        connNum--;
+    }
+    return results;
+}
+
+connectInfo TCPDataTransfer::toConnectInfo(uint64_t connId, const connRecord& record)
+{
+    connectInfo info{};
+    info.connId = connId;
+    info.socketFd = record.socketFd;
+    char clientIp[INET_ADDRSTRLEN] = {};
+    in_addr clientAddr{record.clientAddr};
+    inet_ntop(AF_INET, &clientAddr, clientIp, sizeof(clientIp));
+    info.clientIp = clientIp;
+    info.clientPort = record.clientPort;
+    info.serverPort = record.serverPort;
+    return info;
+}
+
+void TCPDataTransfer::setConnectCallback(ConnectCallback callback)
+{
+    auto shared = callback ? std::make_shared<const ConnectCallback>(std::move(callback)) : nullptr;
+    std::atomic_store(&connectCallback_, std::move(shared));
+}
+
+void TCPDataTransfer::onConnect(uint64_t connId, int socketFd, int error)
+{
+    if (error != 0) {
+        std::unique_lock<std::shared_mutex> locl(connMutex_);
+        auto it = connections_.find(connId);
+        if (it != connections_.end() && it->second.socketFd == socketFd) {
+            connections_.erase(it);
+            connNum--;
+            LOG_INFO("Connection for userId " << connId << " removed, connect failed.");
+        }
     }
-    if (!epollConsumerPool_->addUserSocket(newConn.socketFd, userId)) {
-        ::close(newConn.socketFd);
-        connNum--;  
-        return connectInfo{};
+    auto callback = std::atomic_load(&connectCallback_);
+    if (callback) {
+        (*callback)(connId, socketFd, error);
     }
-    newConn.connId = userId;
+}
+
+void TCPDataTransfer::setDisconnectCallback(DisconnectCallback callback)
+{
+    auto shared = callback ? std::make_shared<const DisconnectCallback>(std::move(callback)) : nullptr;
+    std::atomic_store(&disconnectCallback_, std::move(shared));
+}
+
+// the socket is still open here, so a matching socketFd cannot belong to a newer connection of the same user
+void TCPDataTransfer::onDisconnect(uint64_t connId, int socketFd, DisconnectReason reason)
+{
     {
         std::unique_lock<std::shared_mutex> locl(connMutex_);
-        connections_[userId] = newConn;
+        auto it = connections_.find(connId);
+        if (it == connections_.end() || it->second.socketFd != socketFd) {
+            return; // removeConnection got there first
+        }
+        connections_.erase(it);
+        connNum--;
+    }
+    LOG_INFO("Connection for userId " << connId << " removed, closed by the consumer.");
+    auto callback = std::atomic_load(&disconnectCallback_);
+    if (callback) {
+        (*callback)(connId, socketFd, reason);
     }
-    return newConn; 
 }
 
 void TCPDataTransfer::removeConnection(uint64_t connId)
@@ -71,7 +186,7 @@ void TCPDataTransfer::removeConnection(uint64_t connId)
     LOG_INFO("Connection for userId " << connId << " removed.");
 } 
 
-bool TCPDataTransfer::buildSocket(connectInfo& conn, const std::string& clientIp, int clientPort)
+bool TCPDataTransfer::buildSocket(connRecord& conn, const std::string& clientIp, int clientPort)
 {
     auto userSocket = ::socket(AF_INET, SOCK_STREAM, 0);
     if (userSocket < 0) {
@@ -99,11 +214,6 @@ bool TCPDataTransfer::buildSocket(connectInfo& conn, const std::string& clientIp
     }
     auto assignedPort = ntohs(assignedAddr.sin_port);
     LOG_INFO("Socket assigned port: " << assignedPort);
-    if (listen(userSocket, SOMAXCONN) < 0) {
-        LOG_ERROR("Socket listen failed.");
-        ::close(userSocket);
-        return false;   
-    }
     if (!optimizeSocket(userSocket)) {
         ::close(userSocket);
         return false;   
@@ -122,10 +232,11 @@ bool TCPDataTransfer::buildSocket(connectInfo& conn, const std::string& clientIp
             ::close(userSocket);
             return false;
         } else {
-            LOG_INFO("Socket connect in progress for socket " << userSocket << ", clientIp " << clientIp << ", wating for consumer thread to handle it.");
+            LOG_DEBUG("Socket connect in progress for socket " << userSocket << ", clientIp " << clientIp << ", wating for consumer thread to handle it.");
         }
     }
     conn.socketFd = userSocket;
+    conn.clientAddr = clientAddr.sin_addr.s_addr;
     conn.serverPort = assignedPort;
     return true;
 }
@@ -154,8 +265,9 @@ bool TCPDataTransfer::optimizeSocket(int socketfd_)
         return false;
     }
 
+    // adaptive sockets start small, their consumer sizes them from TCP_INFO once they send
     int sndBuf = 1 << 20; // 1MB
-    if (setsockopt(socketfd_, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) < 0) {
+    if (!poolOptions().socketBuffers.adaptive && setsockopt(socketfd_, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) < 0) {
         LOG_ERROR("setsockopt SO_SNDBUF failed.");
         return false;
     }
@@ -183,24 +295,114 @@ bool TCPDataTransfer::optimizeSocket(int socketfd_)
 void TCPDataTransfer::init()
 {
     LOG_INFO("TCPDataTransfer initialized.");
-    epollConsumerPool_ = std::make_unique<EpollConsumerPool>();
+    maxConnections_ = poolOptions().maxConnections;
+    connections_.reserve(maxConnections_);
+    epollConsumerPool_ = std::make_unique<EpollConsumerPool>(poolOptions());
+    epollConsumerPool_->setConnectCallback([this](uint64_t connId, int socketFd, int error) {
+        onConnect(connId, socketFd, error);
+    });
+    epollConsumerPool_->setDisconnectCallback([this](uint64_t connId, int socketFd, DisconnectReason reason) {
+        onDisconnect(connId, socketFd, reason);
+    });
 }
 
-bool TCPDataTransfer::sendData(int socketFd, uint64_t connId, const char* data, size_t len)
+// the pool's connection table rejects unknown or reused fds, no need to consult connections_ here
+SendResult TCPDataTransfer::sendData(int socketFd, uint64_t connId, const char* data, size_t len, SendPriority priority)
 {
+    return logSendResult(epollConsumerPool_->sendData(socketFd, connId, data, len, priority), connId, len);
+}
+
+SendResult TCPDataTransfer::sendData(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority)
+{
+    size_t len = data.size();
+    return logSendResult(epollConsumerPool_->sendData(socketFd, connId, std::move(data), priority), connId, len);
+}
+
+SendResult TCPDataTransfer::sendData(int socketFd, uint64_t connId, const sendSpan* spans, size_t count, SendPriority priority)
+{
+    return logSendResult(epollConsumerPool_->sendData(socketFd, connId, spans, count, priority), connId,
+        PayloadBuffer::totalSize(spans, count));
+}
+
+SendResult TCPDataTransfer::sendFile(int socketFd, uint64_t connId, int fileFd, off_t offset, size_t len)
+{
+    return logSendResult(epollConsumerPool_->sendFile(socketFd, connId, fileFd, offset, len), connId, len);
+}
+
+// OK stays silent, formatting a log line per message would put the allocator back on the send path
+SendResult TCPDataTransfer::logSendResult(SendResult result, uint64_t connId, size_t len)
+{
+    switch (result) {
+        case SendResult::OK:
+            break;
+        case SendResult::WOULD_BLOCK:
+        case SendResult::OVER_LIMIT:
+            LOG_DEBUG("EpollConsumerPool refused " << len << " bytes for connId " << connId << ", send budget exhausted");
+            break;
+        default:
+            LOG_ERROR("EpollConsumerPool failed to send data for connId " << connId);
+            break;
+    }
+    return result;
+}
+
+void TCPDataTransfer::setRecvCallback(RecvCallback callback)
+{
+    epollConsumerPool_->setRecvCallback(std::move(callback));
+}
+
+void TCPDataTransfer::setWritableCallback(WritableCallback callback)
+{
+    epollConsumerPool_->setWritableCallback(std::move(callback));
+}
+
+bool TCPDataTransfer::setConnRecvCallback(uint64_t connId, RecvCallback callback)
+{
+    int socketFd = -1;
     {
         std::shared_lock<std::shared_mutex> locl(connMutex_);
         auto it = connections_.find(connId);
         if (it == connections_.end()) {
-            LOG_ERROR("Connection for connId " << connId << " not found. SEND DATA FAILED.");
+            LOG_ERROR("Connection for connId " << connId << " not found. SET RECV CALLBACK FAILED.");
             return false;
         }
+        socketFd = it->second.socketFd;
     }
-    if (epollConsumerPool_->sendData(socketFd, connId, data, len)) {
-        LOG_INFO("EpollConsumerPool sent data for connId " << connId << ", socket " << socketFd << ", data length: " << len);
-        return true;
-    } 
-    LOG_ERROR("EpollConsumerPool failed to send data for connId " << connId);
-    return false;
+    return epollConsumerPool_->setConnRecvCallback(socketFd, connId, std::move(callback));
+}
+
+bool TCPDataTransfer::setConnCoalescing(uint64_t connId, bool enable)
+{
+    int socketFd = -1;
+    {
+        std::shared_lock<std::shared_mutex> locl(connMutex_);
+        auto it = connections_.find(connId);
+        if (it == connections_.end()) {
+            LOG_ERROR("Connection for connId " << connId << " not found. SET COALESCING FAILED.");
+            return false;
+        }
+        socketFd = it->second.socketFd;
+    }
+    return epollConsumerPool_->setConnCoalescing(socketFd, connId, enable);
+}
+
+void TCPDataTransfer::setZeroCopyThreshold(size_t bytes)
+{
+    epollConsumerPool_->setZeroCopyThreshold(bytes);
+}
+
+sendStats TCPDataTransfer::getSendStats() const
+{
+    return epollConsumerPool_->getSendStats();
+}
+
+consumerMetrics TCPDataTransfer::getMetrics() const
+{
+    return epollConsumerPool_->getMetrics();
+}
+
+bufferPoolStats TCPDataTransfer::getBufferPoolStats() const
+{
+    return epollConsumerPool_->getBufferPoolStats();
+}
 }
-}
\ No newline at end of file
@@ -9,26 +9,128 @@
 #include <netinet/in.h>
 
 namespace TCPDataTransfer {
+struct connectRequest {
+    uint64_t userId;
+    std::string clientIp;
+    int clientPort;
+};
+
 class TCPDataTransfer {
 public:
     static TCPDataTransfer& instance();
+    /**
+     * Options for the consumer pool, only honoured when called before the first instance().
+     */
+    static void setPoolOptions(const consumerPoolOptions& options);
 
+    /**
+     * Starts a non-blocking connect and returns right away, the owning consumer finishes it and reports the
+     * outcome through the connect callback. Data sent before that is queued and goes out once connected.
+     * @return empty connectInfo if the connect could not even be started.
+     */
     connectInfo buildConnection(uint64_t userId, const std::string& clientIp, int clientPort);
+    /**
+     * buildConnection for many users at once, e.g. a reconnect storm. Sockets are set up without holding
+     * connMutex_ and the connect table is updated once for the whole batch. Results follow the request order.
+     */
+    std::vector<connectInfo> buildConnections(const std::vector<connectRequest>& requests);
+    /**
+     * Called on the consumer thread once a connect finished, error is 0 on success. Failed connections are
+     * already removed when it runs.
+     */
+    void setConnectCallback(ConnectCallback callback);
+    /**
+     * Called on the consumer thread when a connection broke or the consumer closed it, as a slow consumer or
+     * after idleTimeoutMs. The connection is already removed when it runs, so buildConnection starts a new one.
+     * Connections ended by removeConnection are not reported.
+     */
+    void setDisconnectCallback(DisconnectCallback callback);
     void removeConnection(uint64_t connId);
-    bool sendData(int socketFd, uint64_t connId, const char* data, size_t len);
+    /**
+     * Nothing is queued unless OK is returned. WOULD_BLOCK and OVER_LIMIT mean the send budget of the
+     * connection or its consumer is used up, the writable callback reports when to retry.
+     */
+    SendResult sendData(int socketFd, uint64_t connId, const char* data, size_t len, SendPriority priority = SendPriority::BULK);
+    /**
+     * Queues a shared payload without copying it, the same PayloadBuffer may be sent to many connections.
+     * CONTROL payloads go out ahead of queued BULK ones, see SendPriority.
+     */
+    SendResult sendData(int socketFd, uint64_t connId, PayloadBuffer data, SendPriority priority = SendPriority::BULK);
+    /**
+     * Sends a message built in parts, e.g. a frame header and its body, without concatenating them first.
+     * The spans are copied once into a single pooled buffer, queued as one message and written with the
+     * messages around it in one gathered write. The caller's memory is free again once this returns.
+     */
+    SendResult sendData(int socketFd, uint64_t connId, const sendSpan* spans, size_t count, SendPriority priority = SendPriority::BULK);
+    /**
+     * Streams len bytes of a regular file from offset straight from the page cache, without copying them
+     * through user memory. Goes out in order with BULK sends, so a frame header sent just before frames the
+     * file contents. fileFd may be closed right after the call, the consumer keeps its own duplicate.
+     */
+    SendResult sendFile(int socketFd, uint64_t connId, int fileFd, off_t offset, size_t len);
+    /**
+     * Registers the callback receiving every inbound frame of every connection.
+     * Callbacks run on the epoll consumer threads and must not block.
+     */
+    void setRecvCallback(RecvCallback callback);
+    /**
+     * Registers a callback for one connection only, it takes precedence over setRecvCallback.
+     */
+    bool setConnRecvCallback(uint64_t connId, RecvCallback callback);
+    /**
+     * Packs the connection's small frames into larger writes, each frame waits at most coalesceDelayUs
+     * of the pool options. Meant for connections carrying bursts of small messages.
+     */
+    bool setConnCoalescing(uint64_t connId, bool enable);
+    /**
+     * Called on the consumer thread when a connection refused with WOULD_BLOCK or OVER_LIMIT can take data again.
+     */
+    void setWritableCallback(WritableCallback callback);
+    /**
+     * Payloads of at least bytes are sent with MSG_ZEROCOPY and released once the kernel reports completion.
+     * Zero copy only pays off for large payloads (roughly 10KB and up), 0 turns it off, which is the default.
+     */
+    void setZeroCopyThreshold(size_t bytes);
+    sendStats getSendStats() const;
+    /**
+     * Consumer loop counters summed over the pool, see EpollConsumerPool::getConsumerMetrics for the per consumer view.
+     */
+    consumerMetrics getMetrics() const;
+    /**
+     * Occupancy of the consumers' buffer pools, see bufferPoolOptions in the pool options.
+     */
+    bufferPoolStats getBufferPoolStats() const;
 private:
     TCPDataTransfer();
     ~TCPDataTransfer();
+    /**
+     * What is kept per connection, the connId is the map key and the address stays binary.
+     * connectInfo with its string is only built for the caller.
+     */
+    struct connRecord {
+        int32_t socketFd;
+        uint32_t clientAddr; // IPv4, network byte order
+        uint16_t clientPort;
+        uint16_t serverPort;
+    };
+
     void init();
-    bool buildSocket(connectInfo& conn, const std::string& clientIp, int clientPort);
+    static connectInfo toConnectInfo(uint64_t connId, const connRecord& record);
+    bool buildSocket(connRecord& conn, const std::string& clientIp, int clientPort);
+    void onConnect(uint64_t connId, int socketFd, int error);
+    void onDisconnect(uint64_t connId, int socketFd, DisconnectReason reason);
     bool optimizeSocket(int socketfd_);
     void loopForConnection();
     bool setSocketNonBlocking(int socketfd);
+    static consumerPoolOptions& poolOptions();
+    static SendResult logSendResult(SendResult result, uint64_t connId, size_t len);
 private:
     std::shared_mutex connMutex_;
-    std::unordered_map<uint64_t, connectInfo> connections_;
+    std::unordered_map<uint64_t, connRecord> connections_; // buckets reserved for maxConnections, no rehash under the lock
     std::atomic<uint64_t> connNum{0};
+    uint64_t maxConnections_{MAX_CONNECTIONS};
     std::unique_ptr<EpollConsumerPool> epollConsumerPool_;
-    std::map<uint64_t, bool> isUserIdConnected_;
+    std::shared_ptr<const ConnectCallback> connectCallback_; // accessed through std::atomic_load/atomic_store
+    std::shared_ptr<const DisconnectCallback> disconnectCallback_; // same
 };
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "TimingWheel.hpp"
+
+namespace TCPDataTransfer {
+TimingWheel::TimingWheel(std::chrono::milliseconds tick)
+    : tick_(tick), origin_(clock::now())
+{
+    for (auto& level : slots_) {
+        for (auto& head : level) {
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+uint64_t TimingWheel::tickOf(clock::time_point time) const
+{
+    if (time <= origin_) {
+        return 0;
+    }
+    return static_cast<uint64_t>((time - origin_) / tick_);
+}
+
+void TimingWheel::schedule(timerNode& node, clock::time_point deadline)
+{
+    if (node.armed()) {
+        unlink(node);
+    }
+    // rounded up so a timer never fires before its deadline
+    uint64_t expiry = tickOf(deadline) + 1;
+    node.expiry = expiry > current_ ? expiry : current_ + 1;
+    insert(node);
+}
+
+void TimingWheel::cancel(timerNode& node)
+{
+    if (node.armed()) {
+        unlink(node);
+    }
+}
+
+void TimingWheel::insert(timerNode& node)
+{
+    const uint64_t span = uint64_t(1) << (WHEEL_BITS * WHEEL_LEVELS);
+    if (node.expiry - current_ >= span) {
+        node.expiry = current_ + span - 1;
+    }
+    uint64_t delta = node.expiry - current_;
+    size_t level = 0;
+    while (level + 1 < WHEEL_LEVELS && delta >= (uint64_t(1) << (WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    timerNode& head = slots_[level][(node.expiry >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+    ++size_;
+}
+
+void TimingWheel::unlink(timerNode& node)
+{
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = node.next = nullptr;
+    --size_;
+}
+
+// redistributes the slot of level that just came due into the levels below it
+void TimingWheel::cascade(size_t level)
+{
+    if (level >= WHEEL_LEVELS) {
+        return;
+    }
+    size_t index = (current_ >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    if (index == 0) {
+        cascade(level + 1);
+    }
+    timerNode& head = slots_[level][index];
+    while (head.next != &head) {
+        timerNode* node = head.next;
+        unlink(*node);
+        insert(*node);
+    }
+}
+
+int TimingWheel::timeoutMs(clock::time_point now) const
+{
+    if (size_ == 0) {
+        return -1;
+    }
+    uint64_t nowTick = tickOf(now);
+    uint64_t ticks = WHEEL_SLOTS - (current_ & (WHEEL_SLOTS - 1));
+    for (uint64_t step = 1; step < ticks; ++step) {
+        const timerNode& head = slots_[0][(current_ + step) & (WHEEL_SLOTS - 1)];
+        if (head.next != &head) {
+            ticks = step;
+            break;
+        }
+    }
+    uint64_t due = current_ + ticks;
+    if (due <= nowTick) {
+        return 0;
+    }
+    auto wait = origin_ + tick_ * due - now;
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count()) + 1;
+}
+}
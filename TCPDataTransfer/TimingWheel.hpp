@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace TCPDataTransfer {
+/**
+ * Intrusive timer, embedded in the object it belongs to so scheduling never allocates.
+ * A node sits in at most one wheel slot at a time.
+ */
+struct timerNode {
+    timerNode* prev{nullptr};
+    timerNode* next{nullptr};
+    uint64_t expiry{0}; // absolute tick
+    int socketFd{-1};   // owner, handed back on expiry
+    bool armed() const { return next != nullptr; }
+};
+
+/**
+ * Hierarchical timing wheel owned by one consumer thread, not thread safe.
+ * WHEEL_LEVELS levels of WHEEL_SLOTS slots each, level n covers WHEEL_SLOTS^(n+1) ticks. Timers are
+ * inserted and cancelled in O(1) and cascade one level down whenever the level below wraps.
+ * Deadlines further out than the wheel spans are clamped, owners are expected to re-check and re-arm.
+ */
+class TimingWheel {
+public:
+    using clock = std::chrono::steady_clock;
+    static const size_t WHEEL_LEVELS = 4;
+    static const size_t WHEEL_BITS = 6;
+    static const size_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+
+    explicit TimingWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(10));
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    /**
+     * Arms node for deadline, re-arming an armed node moves it.
+     */
+    void schedule(timerNode& node, clock::time_point deadline);
+    void cancel(timerNode& node);
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    /**
+     * Moves the wheel up to now and calls onExpired(timerNode&) for every timer that became due. The node is
+     * already disarmed when the callback runs, the callback may schedule or cancel any node.
+     */
+    template<typename OnExpired>
+    void advance(clock::time_point now, OnExpired&& onExpired)
+    {
+        uint64_t target = tickOf(now);
+        if (size_ == 0) {
+            current_ = target > current_ ? target : current_;
+            return;
+        }
+        while (current_ < target) {
+            ++current_;
+            if ((current_ & (WHEEL_SLOTS - 1)) == 0) {
+                cascade(1);
+            }
+            timerNode& head = slots_[0][current_ & (WHEEL_SLOTS - 1)];
+            while (head.next != &head) {
+                timerNode* node = head.next;
+                unlink(*node);
+                onExpired(*node);
+            }
+            if (size_ == 0) {
+                current_ = target;
+                break;
+            }
+        }
+    }
+
+    /**
+     * Milliseconds until the wheel next needs advance(), -1 without timers. Exact for timers inside the
+     * first level, otherwise the time until the first level wraps and the next cascade is due.
+     */
+    int timeoutMs(clock::time_point now) const;
+private:
+    uint64_t tickOf(clock::time_point time) const;
+    void insert(timerNode& node);
+    void unlink(timerNode& node);
+    void cascade(size_t level);
+private:
+    std::chrono::nanoseconds tick_;
+    clock::time_point origin_;
+    uint64_t current_{0};
+    size_t size_{0};
+    timerNode slots_[WHEEL_LEVELS][WHEEL_SLOTS]; // sentinels of circular lists
+};
+}